@@ -1,7 +1,9 @@
 struct buf;
 struct context;
 struct file;
+struct frame;
 struct inode;
+struct map_en;
 struct pipe;
 struct proc;
 struct rtcdate;
@@ -70,6 +72,12 @@ char*           kalloc(void);
 void            kfree(char*);
 void            kinit1(void*, void*);
 void            kinit2(void*, void*);
+void            kref(char*);
+int             kunref(char*);
+int             krefcount(char*);
+struct frame*   kframe(char*);
+char*           khugealloc(void);
+void            khugefree(char*);
 
 // kbd.c
 void            kbdintr(void);
@@ -97,6 +105,12 @@ void            mpinit(void);
 void            picenable(int);
 void            picinit(void);
 
+// pcache.c
+void            pcacheinit(void);
+char*           pcacheget(void*, uint);
+int             pcacheadd(void*, uint, char*);
+void            pcacheput(void*, uint);
+
 // pipe.c
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
@@ -186,6 +200,8 @@ void            freevm(pde_t*);
 void            inituvm(pde_t*, char*, uint);
 int             loaduvm(pde_t*, char*, struct inode*, uint, uint);
 pde_t*          copyuvm(pde_t*, uint);
+int             cowfault(pde_t*, uint);
+int             cowdiscard(pde_t*, uint);
 void            switchuvm(struct proc*);
 void            switchkvm(void);
 int             copyout(pde_t*, uint, void*, uint);
@@ -198,6 +214,14 @@ uint			wremap(uint, int, int, int);
 int				getwmapinfo(struct wmapinfo*);
 int				getpgdirinfo(struct pgdirinfo*);
 int				pf_handler(struct proc*, uint);
+int				getwmapinfofrom(struct wmapinfo*, uint);
+int				wmadvise(uint, int);
+int				wmsync(uint, int);
+void			wmapinit(void);
+struct map_en*	wmclone(struct map_en*);
+void			wmfreeall(struct map_en*);
+void			wmunmapall(struct proc*);
+int				wmfork(struct proc*, struct proc*);
 
 // number of elements in fixed-size array
 #define NELEM(x) (sizeof(x)/sizeof((x)[0]))
@@ -7,6 +7,7 @@
 #include "param.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "x86.h"
 #include "spinlock.h"
 
 void freerange(void *vstart, void *vend);
@@ -23,6 +24,16 @@ struct {
   struct run *freelist;
 } kmem;
 
+// Per-frame metadata, indexed by physical page number.
+// ref is updated with atomic instructions, so sharers
+// never need kmem.lock to take or drop a reference.
+// flags are plain loads and stores, protected by the
+// lock of whoever owns the frame: kmem.lock for
+// FRAME_FREE and FRAME_HUGE, pcache.lock for
+// FRAME_PCACHE, and the page table's owner alone
+// for FRAME_PGDIR.
+struct frame frames[PHYSTOP/PGSIZE];
+
 // Initialization happens in two phases.
 // 1. main() calls kinit1() while still using entrypgdir to place just
 // the pages mapped by entrypgdir on free list.
@@ -51,24 +62,103 @@ freerange(void *vstart, void *vend)
   for(; p + PGSIZE <= (char*)vend; p += PGSIZE)
     kfree(p);
 }
+
+// Metadata for the frame holding kernel address v.
+struct frame*
+kframe(char *v)
+{
+  if((uint)v % PGSIZE || v < end || V2P(v) >= PHYSTOP)
+    panic("kframe");
+  return &frames[V2P(v)/PGSIZE];
+}
+
+// The first frame of the 4 MiB run that the FRAME_HUGE
+// frame at v belongs to.
+static char*
+khugehead(char *v)
+{
+  return (char*)((uint)v & ~(HUGEPGSIZE - 1));
+}
+
+// Take another reference to the allocated page at v,
+// e.g. for a second page table entry that maps it.
+void
+kref(char *v)
+{
+  struct frame *f = kframe(v);
+
+  if(f->flags & FRAME_HUGE)
+    f = kframe(khugehead(v));
+
+  if(f->ref == 0)
+    panic("kref free page");
+  atomic_incw(&f->ref);
+}
+
+// Drop a reference to the page at v without freeing it.
+// Returns the references left; at 0 the caller owns the
+// page alone and must eventually kfree it.
+int
+kunref(char *v)
+{
+  struct frame *f = kframe(v);
+  ushort r;
+
+  do {
+    r = f->ref;
+    if(r == 0)
+      panic("kunref");
+  } while(cmpxchgw(&f->ref, r, r - 1) != r);
+  return r - 1;
+}
+
+// Number of references to the page at v.
+int
+krefcount(char *v)
+{
+  return kframe(v)->ref;
+}
+
 //PAGEBREAK: 21
-// Free the page of physical memory pointed at by v,
-// which normally should have been returned by a
+// Drop a reference to the page of physical memory pointed
+// at by v, which normally should have been returned by a
 // call to kalloc().  (The exception is when
 // initializing the allocator; see kinit above.)
+// The page is freed when its last reference goes away.
 void
 kfree(char *v)
 {
+  struct frame *f = kframe(v);
   struct run *r;
+  ushort ref;
 
-  if((uint)v % PGSIZE || v < end || V2P(v) >= PHYSTOP)
-    panic("kfree");
+  if(f->flags & FRAME_HUGE){
+    khugefree(khugehead(v));
+    return;
+  }
+
+  // A page with one reference, or none (see kunref
+  // and freerange), is freed; otherwise just drop one.
+  for(;;){
+    ref = f->ref;
+    if(ref <= 1){
+      if(cmpxchgw(&f->ref, ref, 0) == ref)
+        break;
+    } else if(cmpxchgw(&f->ref, ref, ref - 1) == ref){
+      return;
+    }
+  }
+  if(f->flags & FRAME_FREE)
+    panic("kfree: double free");
+  if(f->flags & (FRAME_PCACHE | FRAME_PGDIR))
+    panic("kfree: page still in use");
 
   // Fill with junk to catch dangling refs.
   memset(v, 1, PGSIZE);
 
   if(kmem.use_lock)
     acquire(&kmem.lock);
+  f->flags = FRAME_FREE;
   r = (struct run*)v;
   r->next = kmem.freelist;
   kmem.freelist = r;
@@ -79,6 +169,7 @@ kfree(char *v)
 // Allocate one 4096-byte page of physical memory.
 // Returns a pointer that the kernel can use.
 // Returns 0 if the memory cannot be allocated.
+// The page starts with one reference and no flags.
 char*
 kalloc(void)
 {
@@ -87,10 +178,78 @@ kalloc(void)
   if(kmem.use_lock)
     acquire(&kmem.lock);
   r = kmem.freelist;
-  if(r)
+  if(r){
     kmem.freelist = r->next;
+    frames[V2P(r)/PGSIZE].ref = 1;
+    frames[V2P(r)/PGSIZE].flags = 0;
+  }
   if(kmem.use_lock)
     release(&kmem.lock);
   return (char*)r;
 }
 
+// Allocate a 4 MiB-aligned run of HUGEPGSIZE bytes for a
+// PTE_PS mapping, or return 0 if no such run is entirely
+// free. The run's frames are unlinked from the free list in
+// one pass over it, since each link lives in the page it
+// names. The first frame carries the run's reference count;
+// free it with khugefree. A 4 KiB piece of the run mapped on
+// its own (see huge_split in wmap.c) shares that count: kref
+// and kfree on the piece take and drop a reference to the
+// whole run.
+char*
+khugealloc(void)
+{
+  uint pa, i;
+  struct frame *f;
+  struct run **rp;
+
+  acquire(&kmem.lock);
+  for(pa = HUGEPGSIZE; pa + HUGEPGSIZE <= PHYSTOP; pa += HUGEPGSIZE){
+    f = &frames[pa/PGSIZE];
+    for(i = 0; i < NPTENTRIES; i++)
+      if((f[i].flags & (FRAME_FREE | FRAME_HUGE)) != FRAME_FREE)
+        break;
+    if(i < NPTENTRIES)
+      continue;
+    for(rp = &kmem.freelist; *rp; ){
+      if(V2P(*rp) - pa < HUGEPGSIZE)
+        *rp = (*rp)->next;
+      else
+        rp = &(*rp)->next;
+    }
+    for(i = 0; i < NPTENTRIES; i++)
+      f[i].flags = FRAME_HUGE;
+    f[0].ref = 1;
+    release(&kmem.lock);
+    return P2V(pa);
+  }
+  release(&kmem.lock);
+  return 0;
+}
+
+// Drop a reference to the 4 MiB page at v, returning its
+// frames to the free list with the last one.
+void
+khugefree(char *v)
+{
+  struct frame *f = kframe(v);
+  struct run *r;
+  uint i;
+
+  if((uint)v % HUGEPGSIZE || !(f->flags & FRAME_HUGE))
+    panic("khugefree");
+  if(kunref(v) > 0)
+    return;
+
+  memset(v, 1, HUGEPGSIZE);
+
+  acquire(&kmem.lock);
+  for(i = 0; i < NPTENTRIES; i++){
+    f[i].flags = FRAME_FREE;
+    r = (struct run*)(v + i*PGSIZE);
+    r->next = kmem.freelist;
+    kmem.freelist = r;
+  }
+  release(&kmem.lock);
+}
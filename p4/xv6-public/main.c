@@ -27,9 +27,11 @@ main(void)
   consoleinit();   // console hardware
   uartinit();      // serial port
   pinit();         // process table
+  wmapinit();      // wmap tree nodes
   tvinit();        // trap vectors
   binit();         // buffer cache
   fileinit();      // file table
+  pcacheinit();    // shared file page cache
   ideinit();       // disk 
   startothers();   // start other processors
   kinit2(P2V(4*1024*1024), P2V(PHYSTOP)); // must come after startothers()
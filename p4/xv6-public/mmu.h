@@ -83,6 +83,7 @@ struct segdesc {
 #define NPDENTRIES      1024    // # directory entries per page directory
 #define NPTENTRIES      1024    // # PTEs per page table
 #define PGSIZE          4096    // bytes mapped by a page
+#define HUGEPGSIZE      (PGSIZE*NPTENTRIES) // bytes mapped by a PTE_PS directory entry
 
 #define PTXSHIFT        12      // offset of PTX in a linear address
 #define PDXSHIFT        22      // offset of PDX in a linear address
@@ -94,7 +95,14 @@ struct segdesc {
 #define PTE_P           0x001   // Present
 #define PTE_W           0x002   // Writeable
 #define PTE_U           0x004   // User
+#define PTE_D           0x040   // Dirty
 #define PTE_PS          0x080   // Page Size
+#define PTE_COW         0x800   // Copy-on-write (software-defined bit)
+
+// Page fault error code flags
+#define FEC_PR          0x1     // Page fault caused by protection violation
+#define FEC_WR          0x2     // Page fault caused by a write
+#define FEC_U           0x4     // Page fault occured while in user mode
 
 // Address in page table or page directory entry
 #define PTE_ADDR(pte)   ((uint)(pte) & ~0xFFF)
@@ -178,4 +186,16 @@ struct gatedesc {
   (gate).off_31_16 = (uint)(off) >> 16;                  \
 }
 
+
+// Metadata kept by kalloc for every physical page frame.
+struct frame {
+  ushort ref;        // References (PTEs, caches, ...); 0 when free
+  ushort flags;      // FRAME_* below
+};
+
+#define FRAME_FREE      0x0001  // On the allocator's free list
+#define FRAME_PCACHE    0x0002  // Owned by the shared page cache
+#define FRAME_PGDIR     0x0004  // A page directory
+#define FRAME_HUGE      0x0008  // Part of a 4 MiB page, see khugealloc
+
 #endif
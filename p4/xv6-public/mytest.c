@@ -14,6 +14,17 @@
 // Does not unmap any mapping
 // Does not check for memory allocation
 // Does not explicitly check for lazy allocation
+//
+// Further tests, each starting and ending with no maps:
+//  - wremap growing in place, moving with MREMAP_MAYMOVE, shrinking
+//  - first-fit placement into the gaps between maps
+//  - fault-around on a file map, and wmadvise turning it off
+//  - one page-cache frame for every shared map of a file page
+//  - wmsync writing dirty shared pages back, across unmapped gaps
+//  - copy-on-write after fork, and shared anonymous maps after fork
+//  - a page shared by fork outliving the process that unmapped it
+//  - several processes allocating and freeing pages at once
+//  - MAP_HUGE maps of 4 MiB pages
 // ====================================================================
 
 char *test_name = "TEST_4";
@@ -22,9 +33,15 @@ char *test_name = "TEST_4";
 #define MMAPBASE 0x60000000
 #define KERNBASE 0x80000000
 #define PGSIZE 4096
+#define HUGEPGSIZE (1024 * PGSIZE)
 #define TRUE 1
 #define FALSE 0
 
+#define NFILEPG 8
+char *filename = "wmtest.txt";
+
+#define NSTRESS 4
+
 void success() {
     printf(1, "\nWMMAP\t SUCCESS\n\n");
     exit();
@@ -61,16 +78,79 @@ void map_exists(struct wmapinfo *info, uint addr, int length, int expected) {
     }
 }
 
-int main() {
-    printf(1, "\n\n%s\n", test_name);
+// index of the map starting at addr in info
+int map_index(struct wmapinfo *info, uint addr) {
+    for (int i = 0; i < info->total_mmaps; i++) {
+        if (info->addr[i] == addr) {
+            return i;
+        }
+    }
+    printf(1, "Cause: no map starts at 0x%x\n", addr);
+    failed();
+    return -1;
+}
 
-	/*
-    // validate initial state
-    struct wmapinfo winfo1;
-    get_n_validate_wmap_info(&winfo1, 0); // no maps exist
-    printf(1, "Initially 0 maps. \tOkay.\n");
-	*/
+uint map_or_fail(uint addr, int length, int flags, int fd) {
+    uint map = wmap(addr, length, flags, fd);
+    if ((int) map < 0 || ((flags & MAP_FIXED) && map != addr)) {
+        printf(1, "Cause: `wmap(0x%x, %d, 0x%x, %d)` returned %d\n", addr, length, flags, fd, map);
+        failed();
+    }
+    return map;
+}
 
+void unmap_or_fail(uint addr) {
+    int ret = wunmap(addr);
+    if (ret < 0) {
+        printf(1, "Cause: `wunmap(0x%x)` returned %d\n", addr, ret);
+        failed();
+    }
+}
+
+// (re)create the test file: NFILEPG pages, page p filled with 'A' + p
+void make_file() {
+    char buf[512];
+    int fd = open(filename, O_CREATE | O_RDWR);
+    if (fd < 0) {
+        printf(1, "Cause: cannot create %s\n", filename);
+        failed();
+    }
+    for (int p = 0; p < NFILEPG; p++) {
+        memset(buf, 'A' + p, sizeof(buf));
+        for (int i = 0; i < PGSIZE / sizeof(buf); i++) {
+            if (write(fd, buf, sizeof(buf)) != sizeof(buf)) {
+                printf(1, "Cause: cannot write %s\n", filename);
+                failed();
+            }
+        }
+    }
+    close(fd);
+}
+
+int open_file() {
+    int fd = open(filename, O_RDWR);
+    if (fd < 0) {
+        printf(1, "Cause: cannot open %s\n", filename);
+        failed();
+    }
+    return fd;
+}
+
+// the byte at off in the test file, read with read()
+char file_byte(int off) {
+    char buf[512];
+    int fd = open_file();
+    for (int i = 0; i <= off / sizeof(buf); i++) {
+        if (read(fd, buf, sizeof(buf)) != sizeof(buf)) {
+            printf(1, "Cause: %s is shorter than %d bytes\n", filename, off + 1);
+            failed();
+        }
+    }
+    close(fd);
+    return buf[off % sizeof(buf)];
+}
+
+void test_fixed() {
     // place one map
     int fd = -1;
     int fixed_anon = MAP_FIXED | MAP_ANONYMOUS | MAP_PRIVATE;
@@ -82,13 +162,445 @@ int main() {
         failed();
     }
 
-	/*
+    struct wmapinfo winfo;
+    get_n_validate_wmap_info(&winfo, 1);   // 1 map exists
+    map_exists(&winfo, map, length, TRUE); // the map exists
+    printf(1, "Map 1 at 0x%x with length %d. \tOkay.\n", map, length);
+
+    unmap_or_fail(map);
+}
+
+void test_wremap() {
+    struct wmapinfo winfo;
+    int fixed_anon = MAP_FIXED | MAP_ANONYMOUS | MAP_PRIVATE;
+    uint addr = MMAPBASE + 0x100000;
+
+    char *a = (char *) map_or_fail(addr, 2 * PGSIZE, fixed_anon, -1);
+    a[0] = 'r';
+    a[PGSIZE] = 's';
+
+    // nothing after it, so it grows in place
+    uint r = wremap(addr, 2 * PGSIZE, 4 * PGSIZE, 0);
+    if (r != addr) {
+        printf(1, "Cause: growing in place returned 0x%x\n", r);
+        failed();
+    }
+    a[3 * PGSIZE] = 't';
+    get_n_validate_wmap_info(&winfo, 1);
+    map_exists(&winfo, addr, 4 * PGSIZE, TRUE);
+    printf(1, "wremap grew in place. \tOkay.\n");
+
+    // a map right after it blocks growing in place
+    uint block = map_or_fail(addr + 4 * PGSIZE, PGSIZE, fixed_anon, -1);
+    r = wremap(addr, 4 * PGSIZE, 8 * PGSIZE, 0);
+    if ((int) r >= 0) {
+        printf(1, "Cause: grew over another map without MREMAP_MAYMOVE\n");
+        failed();
+    }
+    r = wremap(addr, 4 * PGSIZE, 8 * PGSIZE, MREMAP_MAYMOVE);
+    if ((int) r < 0 || r == addr) {
+        printf(1, "Cause: moving returned 0x%x\n", r);
+        failed();
+    }
+    char *b = (char *) r;
+    if (b[0] != 'r' || b[PGSIZE] != 's' || b[3 * PGSIZE] != 't') {
+        printf(1, "Cause: contents did not move with the map\n");
+        failed();
+    }
+    get_n_validate_wmap_info(&winfo, 2);
+    map_exists(&winfo, r, 8 * PGSIZE, TRUE);
+    map_exists(&winfo, addr, 4 * PGSIZE, FALSE);
+    printf(1, "wremap moved to 0x%x. \tOkay.\n", r);
+
+    if (wremap(r, 8 * PGSIZE, PGSIZE, 0) != r || b[0] != 'r') {
+        printf(1, "Cause: shrinking in place failed\n");
+        failed();
+    }
+    get_n_validate_wmap_info(&winfo, 2);
+    map_exists(&winfo, r, PGSIZE, TRUE);
+    printf(1, "wremap shrank in place. \tOkay.\n");
+
+    unmap_or_fail(r);
+    unmap_or_fail(block);
+}
+
+void test_gap() {
+    struct wmapinfo winfo;
+    int fixed_anon = MAP_FIXED | MAP_ANONYMOUS | MAP_PRIVATE;
+
+    uint lo = map_or_fail(MMAPBASE, PGSIZE, fixed_anon, -1);
+    uint hi = map_or_fail(MMAPBASE + 3 * PGSIZE, PGSIZE, fixed_anon, -1);
+
+    // the two-page hole between them is the first that fits
+    uint fit = map_or_fail(0, 2 * PGSIZE, MAP_ANONYMOUS | MAP_PRIVATE, -1);
+    if (fit != MMAPBASE + PGSIZE) {
+        printf(1, "Cause: 2 pages placed at 0x%x, not in the hole\n", fit);
+        failed();
+    }
+    // a second one no longer fits there
+    uint after = map_or_fail(0, 2 * PGSIZE, MAP_ANONYMOUS | MAP_PRIVATE, -1);
+    if (after != MMAPBASE + 4 * PGSIZE) {
+        printf(1, "Cause: 2 more pages placed at 0x%x, not after the last map\n", after);
+        failed();
+    }
+    get_n_validate_wmap_info(&winfo, 4);
+    printf(1, "First fit into the gap between maps. \tOkay.\n");
+
+    unmap_or_fail(lo);
+    unmap_or_fail(hi);
+    unmap_or_fail(fit);
+    unmap_or_fail(after);
+}
+
+void test_faultaround() {
+    struct wmapinfo winfo;
+    int fd = open_file();
+
+    // touching every page in order doubles the window: faults at pages
+    // 0, 1, 3 and 7 map 1, 2, 4 and the last 1 page
+    char *a = (char *) map_or_fail(0, NFILEPG * PGSIZE, MAP_PRIVATE, fd);
+    for (int p = 0; p < NFILEPG; p++) {
+        if (a[p * PGSIZE] != 'A' + p) {
+            printf(1, "Cause: page %d of the file map holds '%c'\n", p, a[p * PGSIZE]);
+            failed();
+        }
+    }
+    get_n_validate_wmap_info(&winfo, 1);
+    int i = map_index(&winfo, (uint) a);
+    if (winfo.n_loaded_pages[i] != NFILEPG || winfo.n_faults[i] != 4 || winfo.n_faultaround[i] != 4) {
+        printf(1, "Cause: %d pages, %d faults, %d mapped ahead; expected %d, 4, 4\n",
+               winfo.n_loaded_pages[i], winfo.n_faults[i], winfo.n_faultaround[i], NFILEPG);
+        failed();
+    }
+    printf(1, "Fault-around mapped ahead of sequential faults. \tOkay.\n");
+
+    // a window of one page turns it off
+    char *b = (char *) map_or_fail(0, NFILEPG * PGSIZE, MAP_PRIVATE, fd);
+    if (wmadvise((uint) b, 1) != 0) {
+        printf(1, "Cause: `wmadvise()` failed\n");
+        failed();
+    }
+    for (int p = 0; p < NFILEPG; p++) {
+        if (b[p * PGSIZE] != 'A' + p) {
+            printf(1, "Cause: page %d of the advised map holds '%c'\n", p, b[p * PGSIZE]);
+            failed();
+        }
+    }
+    get_n_validate_wmap_info(&winfo, 2);
+    i = map_index(&winfo, (uint) b);
+    if (winfo.n_faults[i] != NFILEPG || winfo.n_faultaround[i] != 0) {
+        printf(1, "Cause: %d faults, %d mapped ahead after wmadvise(1)\n", winfo.n_faults[i], winfo.n_faultaround[i]);
+        failed();
+    }
+    printf(1, "wmadvise(1) faults every page. \tOkay.\n");
+
+    unmap_or_fail((uint) a);
+    unmap_or_fail((uint) b);
+    close(fd);
+}
+
+void test_pcache() {
+    int fd = open_file();
+    char *a = (char *) map_or_fail(0, NFILEPG * PGSIZE, MAP_SHARED, fd);
+    char *b = (char *) map_or_fail(0, NFILEPG * PGSIZE, MAP_SHARED, fd);
+
+    a[10] = 'x';
+    if (b[10] != 'x') {
+        printf(1, "Cause: a store through one shared map is not seen by the other\n");
+        failed();
+    }
+    printf(1, "Shared maps of a file share its pages. \tOkay.\n");
+
+    // another process mapping the file shares the same frame
+    int pid = fork();
+    if (pid < 0) {
+        printf(1, "Cause: `fork()` failed\n");
+        failed();
+    }
+    if (pid == 0) {
+        int cfd = open_file();
+        char *c = (char *) map_or_fail(0, NFILEPG * PGSIZE, MAP_SHARED, cfd);
+        if (c[10] != 'x') {
+            printf(1, "Cause: another process does not see the store\n");
+            failed();
+        }
+        c[PGSIZE + 10] = 'y';
+        exit();
+    }
+    wait();
+    if (a[PGSIZE + 10] != 'y' || b[PGSIZE + 10] != 'y') {
+        printf(1, "Cause: a store by another process is not seen\n");
+        failed();
+    }
+    printf(1, "Processes mapping a file share its pages. \tOkay.\n");
+
+    unmap_or_fail((uint) a);
+    unmap_or_fail((uint) b);
+    close(fd);
+    make_file();
+}
+
+void test_wmsync() {
+    int fd = open_file();
+    char *a = (char *) map_or_fail(0, NFILEPG * PGSIZE, MAP_SHARED, fd);
+
+    a[0] = 'S';
+    a[2 * PGSIZE + 5] = 'T';
+    if (wmsync((uint) a, 3 * PGSIZE) != 0) {
+        printf(1, "Cause: `wmsync()` failed\n");
+        failed();
+    }
+    if (file_byte(0) != 'S' || file_byte(2 * PGSIZE + 5) != 'T') {
+        printf(1, "Cause: the file does not hold the synced stores\n");
+        failed();
+    }
+    if (wmsync((uint) a + 1, PGSIZE) == 0) {
+        printf(1, "Cause: `wmsync()` took an unaligned address\n");
+        failed();
+    }
+    printf(1, "wmsync wrote dirty pages back. \tOkay.\n");
+
+    // a range running past the map into unmapped pages
+    a[4 * PGSIZE] = 'U';
+    if (wmsync((uint) a + 4 * PGSIZE, (NFILEPG - 4 + 16) * PGSIZE) != 0) {
+        printf(1, "Cause: `wmsync()` over an unmapped gap failed\n");
+        failed();
+    }
+    if (file_byte(4 * PGSIZE) != 'U') {
+        printf(1, "Cause: the file does not hold the store before the gap\n");
+        failed();
+    }
+    printf(1, "wmsync skipped the gap. \tOkay.\n");
+
+    unmap_or_fail((uint) a);
+    close(fd);
+    make_file();
+}
+
+void test_fork() {
+    struct pfstat st;
+    char *a = (char *) map_or_fail(0, 2 * PGSIZE, MAP_ANONYMOUS | MAP_PRIVATE, -1);
+    char *s = (char *) map_or_fail(0, 2 * PGSIZE, MAP_ANONYMOUS | MAP_SHARED, -1);
+
+    a[0] = 'p';
+    s[0] = 'q';
+    // s[PGSIZE] is left untouched until the child writes it
+    int pid = fork();
+    if (pid < 0) {
+        printf(1, "Cause: `fork()` failed\n");
+        failed();
+    }
+    if (pid == 0) {
+        if (a[0] != 'p' || s[0] != 'q') {
+            printf(1, "Cause: the child does not see the parent's pages\n");
+            failed();
+        }
+        a[0] = 'c';
+        getpfstat(&st);
+        int cow = 0;
+        for (int i = 0; i < NPFHIST; i++) {
+            cow += st.cowhist[i];
+        }
+        if (cow == 0) {
+            printf(1, "Cause: the child's store took no copy-on-write fault\n");
+            failed();
+        }
+        // last, so the parent sees it only if the child passed
+        s[PGSIZE] = 'c';
+        exit();
+    }
+    wait();
+    if (a[0] != 'p') {
+        printf(1, "Cause: the child's store to a private page reached the parent\n");
+        failed();
+    }
+    printf(1, "Private pages are copied on write after fork. \tOkay.\n");
+    if (s[PGSIZE] != 'c') {
+        printf(1, "Cause: the child's store to a shared page is not seen\n");
+        failed();
+    }
+    printf(1, "Shared anonymous pages stay shared after fork. \tOkay.\n");
+
+    unmap_or_fail((uint) a);
+    unmap_or_fail((uint) s);
+}
+
+void test_refs() {
+    int go[2], res[2];
+    char c;
+    char *a = (char *) map_or_fail(0, PGSIZE, MAP_ANONYMOUS | MAP_PRIVATE, -1);
+
+    a[0] = 'r';
+    if (pipe(go) < 0 || pipe(res) < 0) {
+        printf(1, "Cause: `pipe()` failed\n");
+        failed();
+    }
+    int pid = fork();
+    if (pid < 0) {
+        printf(1, "Cause: `fork()` failed\n");
+        failed();
+    }
+    if (pid == 0) {
+        // read the page only once the parent has dropped it
+        read(go[0], &c, 1);
+        write(res[1], &a[0], 1);
+        exit();
+    }
+    unmap_or_fail((uint) a);
+    write(go[1], "g", 1);
+    if (read(res[0], &c, 1) != 1 || c != 'r') {
+        printf(1, "Cause: the child lost the page its parent unmapped\n");
+        failed();
+    }
+    wait();
+    printf(1, "A page shared by fork outlives one unmap. \tOkay.\n");
+
+    close(go[0]);
+    close(go[1]);
+    close(res[0]);
+    close(res[1]);
+}
+
+void test_stress() {
+    int res[2];
+    char c;
+
+    if (pipe(res) < 0) {
+        printf(1, "Cause: `pipe()` failed\n");
+        failed();
+    }
+    // children on different CPUs take and return pages at the same time
+    for (int k = 0; k < NSTRESS; k++) {
+        int pid = fork();
+        if (pid < 0) {
+            printf(1, "Cause: `fork()` failed\n");
+            failed();
+        }
+        if (pid == 0) {
+            for (int round = 0; round < 8; round++) {
+                char *a = (char *) map_or_fail(0, 32 * PGSIZE, MAP_ANONYMOUS | MAP_PRIVATE, -1);
+                for (int p = 0; p < 32; p++) {
+                    a[p * PGSIZE] = 'a' + k;
+                    a[p * PGSIZE + PGSIZE - 1] = 'a' + k;
+                }
+                for (int p = 0; p < 32; p++) {
+                    if (a[p * PGSIZE] != 'a' + k || a[p * PGSIZE + PGSIZE - 1] != 'a' + k) {
+                        printf(1, "Cause: child %d found another's store in its page\n", k);
+                        failed();
+                    }
+                }
+                unmap_or_fail((uint) a);
+            }
+            write(res[1], "k", 1);
+            exit();
+        }
+    }
+    for (int k = 0; k < NSTRESS; k++) {
+        wait();
+    }
+    close(res[1]);
+    int passed = 0;
+    while (read(res[0], &c, 1) == 1) {
+        passed++;
+    }
+    close(res[0]);
+    if (passed != NSTRESS) {
+        printf(1, "Cause: %d of %d children failed\n", NSTRESS - passed, NSTRESS);
+        failed();
+    }
+    printf(1, "%d processes allocated and freed pages at once. \tOkay.\n", NSTRESS);
+}
+
+void test_huge() {
+    struct wmapinfo winfo;
+    int fd = open_file();
+
+    if ((int) wmap(0, HUGEPGSIZE, MAP_PRIVATE | MAP_HUGE, fd) >= 0) {
+        printf(1, "Cause: MAP_HUGE was taken for a file map\n");
+        failed();
+    }
+    close(fd);
+
+    char *h = (char *) map_or_fail(0, 2 * HUGEPGSIZE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_HUGE, -1);
+    if ((uint) h % HUGEPGSIZE != 0) {
+        printf(1, "Cause: MAP_HUGE map at 0x%x is not 4 MiB aligned\n", h);
+        failed();
+    }
+    h[0] = 'h';
+    get_n_validate_wmap_info(&winfo, 1);
+    // one 4 MiB page, or one 4 KiB page if no 4 MiB run was free
+    int loaded = winfo.n_loaded_pages[0];
+    if (loaded != HUGEPGSIZE / PGSIZE && loaded != 1) {
+        printf(1, "Cause: one store loaded %d pages\n", loaded);
+        failed();
+    }
+    h[HUGEPGSIZE - 1] = 'i';
+    h[HUGEPGSIZE] = 'j';
+    if (h[0] != 'h' || h[HUGEPGSIZE - 1] != 'i' || h[HUGEPGSIZE] != 'j') {
+        printf(1, "Cause: MAP_HUGE map lost a store\n");
+        failed();
+    }
+    printf(1, "MAP_HUGE map, %s. \tOkay.\n", loaded == 1 ? "4 KiB pages" : "4 MiB pages");
+
+    unmap_or_fail((uint) h);
+    get_n_validate_wmap_info(&winfo, 0);
+
+    // a shared 4 MiB page split by one process stays shared with the other
+    char *s = (char *) map_or_fail(0, 2 * HUGEPGSIZE, MAP_ANONYMOUS | MAP_SHARED | MAP_HUGE, -1);
+    s[HUGEPGSIZE] = 's';
+    int pid = fork();
+    if (pid < 0) {
+        printf(1, "Cause: `fork()` failed\n");
+        failed();
+    }
+    if (pid == 0) {
+        // shrinking cuts into the second 4 MiB page
+        if (wremap((uint) s, 2 * HUGEPGSIZE, HUGEPGSIZE + PGSIZE, 0) != (uint) s) {
+            printf(1, "Cause: shrinking the shared MAP_HUGE map failed\n");
+            failed();
+        }
+        if (s[HUGEPGSIZE] != 's') {
+            printf(1, "Cause: the split page lost the parent's store\n");
+            failed();
+        }
+        s[HUGEPGSIZE] = 'c';
+        exit();
+    }
+    wait();
+    if (s[HUGEPGSIZE] != 'c') {
+        printf(1, "Cause: the child's store to its split shared page is not seen\n");
+        failed();
+    }
+    printf(1, "A split shared MAP_HUGE page stays shared. \tOkay.\n");
+
+    unmap_or_fail((uint) s);
+}
+
+int main() {
+    printf(1, "\n\n%s\n", test_name);
+
+    // validate initial state
+    struct wmapinfo winfo1;
+    get_n_validate_wmap_info(&winfo1, 0); // no maps exist
+    printf(1, "Initially 0 maps. \tOkay.\n");
+
+    make_file();
+    test_fixed();
+    test_wremap();
+    test_gap();
+    test_faultaround();
+    test_pcache();
+    test_wmsync();
+    test_fork();
+    test_refs();
+    test_stress();
+    test_huge();
+    unlink(filename);
+
     // validate final state
     struct wmapinfo winfo2;
-    get_n_validate_wmap_info(&winfo2, 1);   // 1 map exists
-    map_exists(&winfo2, map, length, TRUE); // the map exists
-    printf(1, "Map 1 at 0x%x with length %d. \tOkay.\n", map, length);
-	*/
+    get_n_validate_wmap_info(&winfo2, 0);
+    printf(1, "Finally 0 maps. \tOkay.\n");
     // test ends
     success();
 }
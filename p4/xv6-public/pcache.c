@@ -0,0 +1,140 @@
+// Page cache for MAP_SHARED mappings.
+//
+// Every page of a file that is mapped shared by at least one
+// process has exactly one physical frame, found by (inode, offset).
+// All shared mappings of that page point their PTEs at the same
+// frame, so writes are visible to every process at once and N
+// mappers hold one copy instead of N. A shared anonymous mapping
+// that has been forked keys its pages the same way, by its
+// backing object in wmap.c in place of the inode.
+//
+// Interface:
+// * pcacheget looks a page up and takes a reference to it.
+// * pcacheadd enters a freshly read page with one reference.
+// * pcacheput drops a reference; the frame is freed with the last one.
+//
+// References are the frame's own kalloc reference count, one per
+// mapping PTE; the cache entry lives exactly as long as that count
+// is non-zero. Taking the first and dropping the last reference
+// both happen under pcache.lock, so lookups never find a dying frame.
+//
+// Callers hold the inode's sleep lock (for an anonymous object,
+// wmanon.lock) across pcacheget and pcacheadd, which keeps two
+// faulting processes from both filling the same page. A cached page
+// is always mapped by someone, and every mapping holds a reference
+// to its file or object, so the key stays valid as long as any of
+// its pages are here.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "spinlock.h"
+
+#define NPCHASH 128
+
+struct pcpage {
+  void *obj;               // inode or anonymous object
+  uint off;                // page-aligned offset in obj
+  char *mem;               // the shared frame
+  struct pcpage *next;     // hash chain, or free list
+};
+
+struct {
+  struct spinlock lock;
+  struct pcpage *hash[NPCHASH];
+  struct pcpage *free;     // spare entries, carved from whole pages
+} pcache;
+
+void
+pcacheinit(void)
+{
+  initlock(&pcache.lock, "pcache");
+}
+
+static struct pcpage**
+pcslot(void *obj, uint off)
+{
+  return &pcache.hash[((uint)obj / sizeof(void*) + off / PGSIZE) % NPCHASH];
+}
+
+// Return the cached frame for page off of obj with its
+// reference count raised, or 0 if it is not cached.
+char*
+pcacheget(void *obj, uint off)
+{
+  struct pcpage *pp;
+  char *mem = 0;
+
+  acquire(&pcache.lock);
+  for(pp = *pcslot(obj, off); pp; pp = pp->next){
+    if(pp->obj == obj && pp->off == off){
+      kref(pp->mem);
+      mem = pp->mem;
+      break;
+    }
+  }
+  release(&pcache.lock);
+  return mem;
+}
+
+// Enter mem as page off of obj with one reference.
+// Returns -1 if there is no memory for the entry.
+int
+pcacheadd(void *obj, uint off, char *mem)
+{
+  struct pcpage *pp;
+  int i;
+
+  acquire(&pcache.lock);
+  if(pcache.free == 0){
+    if((pp = (struct pcpage*)kalloc()) == 0){
+      release(&pcache.lock);
+      return -1;
+    }
+    for(i = 0; i < PGSIZE / sizeof(*pp); i++){
+      pp[i].next = pcache.free;
+      pcache.free = &pp[i];
+    }
+  }
+  pp = pcache.free;
+  pcache.free = pp->next;
+
+  pp->obj = obj;
+  pp->off = off;
+  pp->mem = mem;
+  kframe(mem)->flags |= FRAME_PCACHE;
+  pp->next = *pcslot(obj, off);
+  *pcslot(obj, off) = pp;
+  release(&pcache.lock);
+  return 0;
+}
+
+// Drop one reference to page off of obj, freeing
+// the frame when no mapping uses it any more.
+void
+pcacheput(void *obj, uint off)
+{
+  struct pcpage **pv, *pp;
+  char *mem;
+
+  acquire(&pcache.lock);
+  for(pv = pcslot(obj, off); (pp = *pv) != 0; pv = &pp->next){
+    if(pp->obj == obj && pp->off == off)
+      break;
+  }
+  if(pp == 0)
+    panic("pcacheput");
+  if(kunref(pp->mem) > 0){
+    release(&pcache.lock);
+    return;
+  }
+  mem = pp->mem;
+  *pv = pp->next;
+  pp->next = pcache.free;
+  pcache.free = pp;
+  release(&pcache.lock);
+
+  kframe(mem)->flags &= ~FRAME_PCACHE;
+  kfree(mem);
+}
@@ -88,6 +88,11 @@ allocproc(void)
 found:
   p->state = EMBRYO;
   p->pid = nextpid++;
+  p->wmaps = 0;
+  p->total_maps = 0;
+  p->wmlast = 0;
+  memset(p->pfhist, 0, sizeof(p->pfhist));
+  memset(p->cowhist, 0, sizeof(p->cowhist));
 
   release(&ptable.lock);
 
@@ -197,24 +202,25 @@ fork(void)
     return -1;
   }
 
-  // copy wmaps
-  for (i = 0; i < 16; i++) {  
-    if(np->wmaps[i].valid == 1) {
-      np->wmaps[i].valid = curproc->wmaps[i].valid;
-      np->wmaps[i].addr = curproc->wmaps[i].addr;
-      np->wmaps[i].length = curproc->wmaps[i].length;
-      np->wmaps[i].lpgs = curproc->wmaps[i].lpgs;
-    }
+  // copy wmaps and share their loaded pages
+  if(curproc->wmaps && (np->wmaps = wmclone(curproc->wmaps)) == 0){
+    freevm(np->pgdir);
+    kfree(np->kstack);
+    np->kstack = 0;
+    np->state = UNUSED;
+    return -1;
   }
-  // copy PTE
-  for (uint va = 0; va < curproc->sz; va += PGSIZE) {
-    pte_t *pte = walkpgdir(np->pgdir, (void*)va, 0);
-    if (pte && (*pte & PTE_P)) {
-      continue;
-    }
-      uint pa = PTE_ADDR(*pte);
-      mappages(np->pgdir, (void*)va, PGSIZE, pa, PTE_FLAGS(*pte));
+  np->total_maps = curproc->total_maps;
+  if(wmfork(np, curproc) < 0){
+    wmunmapall(np);
+    freevm(np->pgdir);
+    kfree(np->kstack);
+    np->kstack = 0;
+    np->state = UNUSED;
+    return -1;
   }
+  // The parent's writable pages are copy-on-write now.
+  lcr3(V2P(curproc->pgdir));
 
   np->sz = curproc->sz;
   np->parent = curproc;
@@ -254,6 +260,9 @@ exit(void)
   if(curproc == initproc)
     panic("init exiting");
 
+  // Write back and release mappings while their files are still open.
+  wmunmapall(curproc);
+
   // Close all open files.
   for(fd = 0; fd < NOFILE; fd++){
     if(curproc->ofile[fd]){
@@ -310,6 +319,9 @@ wait(void)
         kfree(p->kstack);
         p->kstack = 0;
         freevm(p->pgdir);
+        wmfreeall(p->wmaps);
+        p->wmaps = 0;
+        p->total_maps = 0;
         p->pid = 0;
         p->parent = 0;
         p->name[0] = 0;
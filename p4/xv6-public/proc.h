@@ -35,12 +35,26 @@ struct context {
 enum procstate { UNUSED, EMBRYO, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
 struct map_en {
-  int valid;
   uint addr;
   int length;
   int lpgs;
   int flags;
-  int fd;
+  struct file *f;              // backing file, 0 for MAP_ANONYMOUS
+  struct wmanon *anon;         // pages of a forked MAP_SHARED|MAP_ANONYMOUS, or 0
+
+  // fault-around state for file-backed mappings
+  int famax;                   // largest window in pages, 0 for WMAP_FAULTAROUND_MAX
+  int fawin;                   // current window in pages
+  uint nextfault;              // page right after the last window
+  int nfaults;                 // page faults taken
+  int nfaultaround;            // extra pages mapped by those faults
+
+  // mapping tree linkage (see wmap.c), ordered by addr
+  struct map_en *left;
+  struct map_en *right;
+  int height;
+  uint gap;                    // free bytes between the previous mapping and addr
+  uint maxgap;                 // largest gap in this subtree
 };
 
 // Per-process state
@@ -60,7 +74,10 @@ struct proc {
   char name[16];               // Process name (debugging)
 
   int total_maps;				// track number of maps
-  struct map_en wmaps[16];		// track each wmap
+  struct map_en *wmaps;			// root of the tree of wmaps
+  struct map_en *wmlast;		// wmap of the last page fault
+  uint pfhist[NPFHIST];			// lazy-fill faults by log2 TSC cycles taken
+  uint cowhist[NPFHIST];		// copy-on-write faults, likewise
 };
 
 // Process memory is laid out contiguously, low addresses first:
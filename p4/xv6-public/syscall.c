@@ -124,6 +124,10 @@ extern int sys_wunmap(void); // edited
 extern int sys_getwmapinfo(void); // edited
 extern int sys_getpgdirinfo(void); // edited
 extern int sys_wremap(void); // edited
+extern int sys_getwmapinfofrom(void);
+extern int sys_wmadvise(void);
+extern int sys_wmsync(void);
+extern int sys_getpfstat(void);
 
 static int (*syscalls[])(void) = {
 [SYS_fork]    sys_fork,
@@ -152,6 +156,10 @@ static int (*syscalls[])(void) = {
 [SYS_getwmapinfo]	sys_getwmapinfo, // edited
 [SYS_getpgdirinfo]	sys_getpgdirinfo, // edited
 [SYS_wremap]	sys_wremap, // edited
+[SYS_getwmapinfofrom]	sys_getwmapinfofrom,
+[SYS_wmadvise]	sys_wmadvise,
+[SYS_wmsync]	sys_wmsync,
+[SYS_getpfstat]	sys_getpfstat,
 };
 
 void
@@ -25,3 +25,7 @@
 #define SYS_getwmapinfo	24 // edited
 #define SYS_getpgdirinfo	25 //edited
 #define SYS_wremap	26 //edited
+#define SYS_getwmapinfofrom	27
+#define SYS_wmadvise	28
+#define SYS_wmsync	29
+#define SYS_getpfstat	30
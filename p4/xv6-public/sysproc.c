@@ -168,3 +168,58 @@ sys_getwmapinfo(void)
 	return getwmapinfo(wminfo);
 }
 
+int
+sys_getwmapinfofrom(void)
+{
+	struct wmapinfo* wminfo;
+	uint from;
+
+    if (argptr(0, (char **)&wminfo, sizeof(struct wmapinfo)) < 0 ||
+        arguint(1, &from) < 0) {
+        return -1;
+    }
+
+	return getwmapinfofrom(wminfo, from);
+}
+
+int
+sys_wmadvise(void)
+{
+	uint addr;
+	int window;
+
+    if (arguint(0, &addr) < 0 || argint(1, &window) < 0) {
+        return -1;
+    }
+
+	return wmadvise(addr, window);
+}
+
+int
+sys_wmsync(void)
+{
+	uint addr;
+	int length;
+
+    if (arguint(0, &addr) < 0 || argint(1, &length) < 0) {
+        return -1;
+    }
+
+	return wmsync(addr, length);
+}
+
+// copy the calling process's page fault latency histograms
+int
+sys_getpfstat(void)
+{
+	struct pfstat *st;
+	struct proc *curproc = myproc();
+
+    if (argptr(0, (char **)&st, sizeof(struct pfstat)) < 0) {
+        return -1;
+    }
+
+	memmove(st->hist, curproc->pfhist, sizeof(st->hist));
+	memmove(st->cowhist, curproc->cowhist, sizeof(st->cowhist));
+	return 0;
+}
@@ -32,10 +32,71 @@ idtinit(void)
   lidt(idt, sizeof(idt));
 }
 
+// Bucket for a fault that took n cycles: floor(log2(n)).
+static int
+pfbucket(uint n)
+{
+  int b;
+
+  for(b = 0; n > 1 && b < NPFHIST - 1; b++)
+    n >>= 1;
+  return b;
+}
+
+// Page faults. Not-present faults in a wmap are filled in
+// by pf_handler and writes to copy-on-write pages are copied
+// by cowfault; the cycles each took are added to p's
+// histograms. Anything else kills p, or panics if it came
+// from the kernel.
+static void
+pgfault(struct proc *p, struct trapframe *tf)
+{
+  uint va = rcr2();
+  uint start = rdtsc();
+  int res = 0;
+
+  if(tf->err & FEC_PR){
+    // Write to a copy-on-write page, from user space or from
+    // the kernel copying into a user buffer.
+    if((tf->err & FEC_WR) && p != 0 && cowfault(p->pgdir, va) == 0){
+      p->cowhist[pfbucket(rdtsc() - start)]++;
+      return;
+    }
+    // Out of memory for the copy a kernel write into user memory
+    // needs: kill the process, not the kernel, and let the write
+    // land where nobody will read it.
+    if((tf->err & FEC_WR) && p != 0 && (tf->cs&3) == 0 &&
+       cowdiscard(p->pgdir, va) == 0){
+      cprintf("pid %d %s: no memory for copy-on-write--kill proc\n",
+              p->pid, p->name);
+      p->killed = 1;
+      return;
+    }
+  } else if(p != 0 && (tf->cs&3) == DPL_USER){
+    if((res = pf_handler(p, va)) == 0){
+      p->pfhist[pfbucket(rdtsc() - start)]++;
+      return;
+    }
+  }
+
+  if(p == 0 || (tf->cs&3) == 0){
+    cprintf("kernel fault va %p ip %p\n", va, tf->eip);
+    panic("kernel fault");
+  }
+  if(tf->err & FEC_PR)
+    cprintf("pid %d %s: protection fault addr 0x%x--kill proc\n",
+            p->pid, p->name, va);
+  else
+    cprintf("page allocation failed, killing process: error: %d\n", res);
+  p->killed = 1;
+}
+
 //PAGEBREAK: 41
 void
 trap(struct trapframe *tf)
 {
+  struct proc *p;
+
   if(tf->trapno == T_SYSCALL){
     if(myproc()->killed)
       exit();
@@ -46,6 +107,18 @@ trap(struct trapframe *tf)
     return;
   }
 
+  // Page faults skip the device dispatch below. T_PGFLT is an
+  // interrupt gate, so interrupts are already off and the proc
+  // can be read straight from this CPU, without myproc()'s
+  // pushcli/popcli.
+  if(tf->trapno == T_PGFLT){
+    p = mycpu()->proc;
+    pgfault(p, tf);
+    if(p && p->killed && (tf->cs&3) == DPL_USER)
+      exit();
+    return;
+  }
+
   switch(tf->trapno){
   case T_IRQ0 + IRQ_TIMER:
     if(cpuid() == 0){
@@ -77,26 +150,6 @@ trap(struct trapframe *tf)
             cpuid(), tf->cs, tf->eip);
     lapiceoi();
     break;
-  // if page fault
-  case T_PGFLT:
-    uint va = rcr2();
-    struct proc *curproc = myproc();
-
-    if (!(tf->cs & 0x3)) {
-      cprintf("kernel fault va %p ip %p\n", va, tf->eip);
-      panic("kernel fault");
-    }
-
-    // Handle user-mode page fault
-	int res = pf_handler(curproc, va);
-    if (res != 0) {
-      // Allocation failed; kill the process
-      cprintf("page allocation failed, killing process: error: %d\n", res);
-      curproc->killed = 1;
-      return;
-    }
-    break;
-
   //PAGEBREAK: 13
   default:
     if(myproc() == 0 || (tf->cs&3) == 0){
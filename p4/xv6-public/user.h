@@ -2,6 +2,7 @@ struct stat;
 struct rtcdate;
 struct wmapinfo;
 struct pgdirinfo;
+struct pfstat;
 
 // system calls
 int fork(void);
@@ -30,6 +31,10 @@ int wunmap(uint); // edited
 int getwmapinfo(struct wmapinfo*); // edited
 int getpgdirinfo(struct pgdirinfo*); // edited
 uint wremap(uint, int, int, int); // edited
+int getwmapinfofrom(struct wmapinfo*, uint);
+int wmadvise(uint, int);
+int wmsync(uint, int);
+int getpfstat(struct pfstat*);
 
 // ulib.c
 int stat(const char*, struct stat*);
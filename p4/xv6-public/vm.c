@@ -10,6 +10,11 @@
 extern char data[];  // defined by kernel.ld
 pde_t *kpgdir;  // for use in scheduler()
 
+// Stands in for a copy-on-write page that could not be copied
+// for a kernel write into user memory; see cowdiscard.
+// Holds a reference of its own, so it is never freed.
+static char *cowsink;
+
 // Set up CPU's kernel segment descriptors.
 // Run once on entry on each CPU.
 void
@@ -32,6 +37,8 @@ seginit(void)
 // Return the address of the PTE in page table pgdir
 // that corresponds to virtual address va.  If alloc!=0,
 // create any required page table pages.
+// Returns 0 inside a 4 MiB (PTE_PS) page, which has no
+// page table; callers that map those check the PDE.
 pte_t *
 walkpgdir(pde_t *pgdir, const void *va, int alloc)
 {
@@ -39,6 +46,8 @@ walkpgdir(pde_t *pgdir, const void *va, int alloc)
   pte_t *pgtab;
 
   pde = &pgdir[PDX(va)];
+  if(*pde & PTE_PS)
+    return 0;
   if(*pde & PTE_P){
     pgtab = (pte_t*)P2V(PTE_ADDR(*pde));
   } else {
@@ -124,6 +133,7 @@ setupkvm(void)
   if((pgdir = (pde_t*)kalloc()) == 0)
     return 0;
   memset(pgdir, 0, PGSIZE);
+  kframe((char*)pgdir)->flags |= FRAME_PGDIR;
   if (P2V(PHYSTOP) > (void*)DEVSPACE)
     panic("PHYSTOP too high");
   for(k = kmap; k < &kmap[NELEM(kmap)]; k++)
@@ -141,6 +151,8 @@ void
 kvmalloc(void)
 {
   kpgdir = setupkvm();
+  if((cowsink = kalloc()) == 0)
+    panic("kvmalloc: cowsink");
   switchkvm();
 }
 
@@ -287,13 +299,18 @@ freevm(pde_t *pgdir)
 
   if(pgdir == 0)
     panic("freevm: no pgdir");
+  if((kframe((char*)pgdir)->flags & FRAME_PGDIR) == 0)
+    panic("freevm: not a pgdir");
   deallocuvm(pgdir, KERNBASE, 0);
   for(i = 0; i < NPDENTRIES; i++){
-    if(pgdir[i] & PTE_P){
+    if(pgdir[i] & PTE_PS){
+      khugefree(P2V(PTE_ADDR(pgdir[i])));
+    } else if(pgdir[i] & PTE_P){
       char * v = P2V(PTE_ADDR(pgdir[i]));
       kfree(v);
     }
   }
+  kframe((char*)pgdir)->flags &= ~FRAME_PGDIR;
   kfree((char*)pgdir);
 }
 
@@ -311,14 +328,17 @@ clearpteu(pde_t *pgdir, char *uva)
 }
 
 // Given a parent process's page table, create a copy
-// of it for a child.
+// of it for a child. Pages are not copied: both page
+// tables map the same frames read-only and marked
+// PTE_COW, and cowfault() copies a page on the first
+// write by either side. The caller must flush the
+// parent's TLB.
 pde_t*
 copyuvm(pde_t *pgdir, uint sz)
 {
   pde_t *d;
   pte_t *pte;
   uint pa, i, flags;
-  char *mem;
 
   if((d = setupkvm()) == 0)
     return 0;
@@ -327,15 +347,13 @@ copyuvm(pde_t *pgdir, uint sz)
       panic("copyuvm: pte should exist");
     if(!(*pte & PTE_P))
       panic("copyuvm: page not present");
+    if(*pte & PTE_W)
+      *pte = (*pte & ~PTE_W) | PTE_COW;
     pa = PTE_ADDR(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
-      goto bad;
-    memmove(mem, (char*)P2V(pa), PGSIZE);
-    if(mappages(d, (void*)i, PGSIZE, V2P(mem), flags) < 0) {
-      kfree(mem);
+    if(mappages(d, (void*)i, PGSIZE, pa, flags) < 0)
       goto bad;
-    }
+    kref(P2V(pa));
   }
   return d;
 
@@ -344,6 +362,59 @@ bad:
   return 0;
 }
 
+// Handle a write to a copy-on-write page at va in pgdir.
+// The last sharer just gets write access back; anyone else
+// gets a private copy. Returns -1 if va is not a COW page
+// or there is no memory for the copy.
+int
+cowfault(pde_t *pgdir, uint va)
+{
+  pte_t *pte;
+  uint pa, flags;
+  char *mem;
+
+  if(va >= KERNBASE || (pte = walkpgdir(pgdir, (void*)va, 0)) == 0)
+    return -1;
+  if(!(*pte & PTE_P) || !(*pte & PTE_U) || !(*pte & PTE_COW))
+    return -1;
+  pa = PTE_ADDR(*pte);
+  flags = (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W;
+  if(krefcount(P2V(pa)) == 1){
+    *pte = pa | flags;
+  } else {
+    if((mem = kalloc()) == 0)
+      return -1;
+    memmove(mem, (char*)P2V(pa), PGSIZE);
+    *pte = V2P(mem) | flags;
+    kfree(P2V(pa));
+  }
+  lcr3(V2P(pgdir));
+  return 0;
+}
+
+// Point the copy-on-write page at va in pgdir at cowsink,
+// for a process being killed because cowfault had no memory
+// to copy it for a kernel write. The write that faulted can
+// then finish. Returns -1 if va is not a COW page.
+int
+cowdiscard(pde_t *pgdir, uint va)
+{
+  pte_t *pte;
+  uint pa, flags;
+
+  if(va >= KERNBASE || (pte = walkpgdir(pgdir, (void*)va, 0)) == 0)
+    return -1;
+  if(!(*pte & PTE_P) || !(*pte & PTE_U) || !(*pte & PTE_COW))
+    return -1;
+  pa = PTE_ADDR(*pte);
+  flags = (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W;
+  kref(cowsink);
+  *pte = V2P(cowsink) | flags;
+  kfree(P2V(pa));
+  lcr3(V2P(pgdir));
+  return 0;
+}
+
 //PAGEBREAK!
 // Map user virtual address to kernel address.
 char*
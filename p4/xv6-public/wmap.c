@@ -3,6 +3,7 @@
 #include "stdio.h"
 #include "types.h"
 #include "defs.h"
+#include "x86.h"
 #include "param.h"
 #include "mmu.h"
 #include "proc.h"
@@ -17,63 +18,713 @@
 #define USERBOUNDARY 0x60000000
 #define KERNBASE 0x80000000
 
+/********** MAPPING TREE ***********/
+
+/*
+ * Each process keeps its mappings in an AVL tree ordered by start address.
+ * Every node also records the free gap between the previous mapping (or
+ * USERBOUNDARY) and its own start, and the largest such gap in its subtree,
+ * so both fault lookup and first-fit placement are O(log n).
+ *
+ * Nodes come from a slab carved out of whole kalloc() pages; freed nodes go
+ * back on the slab's free list and the pages are kept for reuse.
+ */
+
+/*
+ * A MAP_SHARED|MAP_ANONYMOUS mapping gets a backing object the first time
+ * it is forked. From then on its 4 KiB pages live in the page cache keyed
+ * by (object, offset), so parent and child fault in the same frame lazily
+ * instead of fork loading every page up front. The object is just that
+ * key plus a count of the mappings using it. Objects share the nodes' slab
+ * and go back to it when the last mapping goes.
+ */
+struct wmanon {
+	int ref;	// mappings backed by this object
+};
+
+union wmslot {
+	struct map_en map;
+	struct wmanon anon;
+	union wmslot *next;	// while free
+};
+
+struct {
+	struct spinlock lock;
+	union wmslot *free;
+	int npages;				// pages handed to the slab so far
+} wmslab;
+
+struct {
+	struct spinlock lock;	// protects ref; also serializes filling a page of an object
+} wmanon;
+
+void wmapinit(void)
+{
+	initlock(&wmslab.lock, "wmslab");
+	initlock(&wmanon.lock, "wmanon");
+}
+
+static union wmslot* wmslotalloc(void)
+{
+	union wmslot *s;
+
+	acquire(&wmslab.lock);
+	if (wmslab.free == 0) {
+		char *pg = kalloc();
+		if (pg == 0) {
+			release(&wmslab.lock);
+			return 0;
+		}
+		union wmslot *slots = (union wmslot*) pg;
+		for (int i = 0; i < PGSIZE / sizeof(union wmslot); i++) {
+			slots[i].next = wmslab.free;
+			wmslab.free = &slots[i];
+		}
+		wmslab.npages++;
+	}
+	s = wmslab.free;
+	wmslab.free = s->next;
+	release(&wmslab.lock);
+	return s;
+}
+
+static void wmslotfree(union wmslot *s)
+{
+	acquire(&wmslab.lock);
+	s->next = wmslab.free;
+	wmslab.free = s;
+	release(&wmslab.lock);
+}
+
+struct map_en* wmalloc(void)
+{
+	union wmslot *s = wmslotalloc();
+
+	if (s == 0)
+		return 0;
+	memset(&s->map, 0, sizeof(s->map));
+	return &s->map;
+}
+
+void wmfree(struct map_en *n)
+{
+	wmslotfree((union wmslot*) n);
+}
+
+static struct wmanon* wmanonalloc(void)
+{
+	union wmslot *s = wmslotalloc();
+
+	if (s == 0)
+		return 0;
+	s->anon.ref = 1;
+	return &s->anon;
+}
+
+static struct wmanon* wmanondup(struct wmanon *a)
+{
+	acquire(&wmanon.lock);
+	a->ref++;
+	release(&wmanon.lock);
+	return a;
+}
+
+// the last mapping's pages are already unmapped, so the cache holds none of its pages
+static void wmanonput(struct wmanon *a)
+{
+	int last;
+
+	acquire(&wmanon.lock);
+	last = --a->ref == 0;
+	release(&wmanon.lock);
+	if (last)
+		wmslotfree((union wmslot*) a);
+}
+
+// flush p's TLB entries if p's page table is the one loaded
+static void wmflush(struct proc *p)
+{
+	if (p == myproc())
+		lcr3(V2P(p->pgdir));
+}
+
+// first address past the mapping, page-rounded
+static uint wmend(struct map_en *n)
+{
+	return n->addr + PGROUNDUP(n->length);
+}
+
+static int wmheight(struct map_en *n)
+{
+	return n ? n->height : 0;
+}
+
+static uint wmmaxgap(struct map_en *n)
+{
+	return n ? n->maxgap : 0;
+}
+
+// recompute the cached height and largest gap of n from its children
+static void wmupdate(struct map_en *n)
+{
+	int lh = wmheight(n->left);
+	int rh = wmheight(n->right);
+	uint g = n->gap;
+
+	n->height = 1 + (lh > rh ? lh : rh);
+	if (wmmaxgap(n->left) > g)
+		g = wmmaxgap(n->left);
+	if (wmmaxgap(n->right) > g)
+		g = wmmaxgap(n->right);
+	n->maxgap = g;
+}
+
+static struct map_en* wmrotright(struct map_en *y)
+{
+	struct map_en *x = y->left;
+	y->left = x->right;
+	x->right = y;
+	wmupdate(y);
+	wmupdate(x);
+	return x;
+}
+
+static struct map_en* wmrotleft(struct map_en *x)
+{
+	struct map_en *y = x->right;
+	x->right = y->left;
+	y->left = x;
+	wmupdate(x);
+	wmupdate(y);
+	return y;
+}
+
+static struct map_en* wmbalance(struct map_en *n)
+{
+	wmupdate(n);
+	int bf = wmheight(n->left) - wmheight(n->right);
+	if (bf > 1) {
+		if (wmheight(n->left->left) < wmheight(n->left->right))
+			n->left = wmrotleft(n->left);
+		return wmrotright(n);
+	}
+	if (bf < -1) {
+		if (wmheight(n->right->right) < wmheight(n->right->left))
+			n->right = wmrotright(n->right);
+		return wmrotleft(n);
+	}
+	return n;
+}
+
+static struct map_en* wminsert1(struct map_en *root, struct map_en *n)
+{
+	if (root == 0)
+		return n;
+	if (n->addr < root->addr)
+		root->left = wminsert1(root->left, n);
+	else
+		root->right = wminsert1(root->right, n);
+	return wmbalance(root);
+}
+
+static struct map_en* wmremovemin(struct map_en *n, struct map_en **min)
+{
+	if (n->left == 0) {
+		*min = n;
+		return n->right;
+	}
+	n->left = wmremovemin(n->left, min);
+	return wmbalance(n);
+}
+
+static struct map_en* wmremove1(struct map_en *root, uint addr)
+{
+	if (root == 0)
+		return 0;
+	if (addr < root->addr) {
+		root->left = wmremove1(root->left, addr);
+	} else if (addr > root->addr) {
+		root->right = wmremove1(root->right, addr);
+	} else {
+		struct map_en *l = root->left;
+		struct map_en *r = root->right;
+		struct map_en *m;
+		if (r == 0)
+			return l;
+		r = wmremovemin(r, &m);
+		m->left = l;
+		m->right = r;
+		return wmbalance(m);
+	}
+	return wmbalance(root);
+}
+
+// nearest mappings before and after addr (either may be 0)
+static void wmneighbors(struct map_en *root, uint addr, struct map_en **pred, struct map_en **succ)
+{
+	*pred = *succ = 0;
+	while (root) {
+		if (root->addr < addr) {
+			*pred = root;
+			root = root->right;
+		} else if (root->addr > addr) {
+			*succ = root;
+			root = root->left;
+		} else {
+			struct map_en *n;
+			for (n = root->left; n; n = n->right)
+				*pred = n;
+			for (n = root->right; n; n = n->left)
+				*succ = n;
+			return;
+		}
+	}
+}
+
+// link a new mapping into the process's tree
+void wminsert(struct proc *p, struct map_en *n)
+{
+	struct map_en *pred, *succ;
+
+	wmneighbors(p->wmaps, n->addr, &pred, &succ);
+	n->left = n->right = 0;
+	n->gap = n->addr - (pred ? wmend(pred) : USERBOUNDARY);
+	n->height = 1;
+	n->maxgap = n->gap;
+	// succ is an ancestor of the new leaf, so the rebalance on the way up refreshes it
+	if (succ)
+		succ->gap = succ->addr - wmend(n);
+	p->wmaps = wminsert1(p->wmaps, n);
+	p->total_maps++;
+}
+
+// unlink a mapping from the process's tree; the node is not freed
+void wmremove(struct proc *p, struct map_en *n)
+{
+	struct map_en *pred, *succ;
+
+	wmneighbors(p->wmaps, n->addr, &pred, &succ);
+	// succ is on the removal path, so its maxgap is refreshed by the rebalance
+	if (succ)
+		succ->gap = succ->addr - (pred ? wmend(pred) : USERBOUNDARY);
+	p->wmaps = wmremove1(p->wmaps, n->addr);
+	p->total_maps--;
+	if (p->wmlast == n)
+		p->wmlast = 0;
+}
+
+// the mapping containing va, 0 if none
+struct map_en* wmlookup(struct proc *p, uint va)
+{
+	struct map_en *n = p->wmaps;
+	while (n) {
+		if (va < n->addr)
+			n = n->left;
+		else if (va >= wmend(n))
+			n = n->right;
+		else
+			return n;
+	}
+	return 0;
+}
+
+// the first mapping starting at or after addr, 0 if none
+struct map_en* wmnext(struct proc *p, uint addr)
+{
+	struct map_en *n = p->wmaps;
+	struct map_en *best = 0;
+	while (n) {
+		if (n->addr >= addr) {
+			best = n;
+			n = n->left;
+		} else {
+			n = n->right;
+		}
+	}
+	return best;
+}
+
+static uint wmfindgap(struct map_en *n, uint need)
+{
+	while (n && n->maxgap >= need) {
+		if (wmmaxgap(n->left) >= need)
+			n = n->left;
+		else if (n->gap >= need)
+			return n->addr - n->gap;
+		else
+			n = n->right;
+	}
+	return 0;
+}
+
+// copy a tree for a forked child; 0 if out of memory
+struct map_en* wmclone(struct map_en *n)
+{
+	struct map_en *c;
+
+	if (n == 0)
+		return 0;
+	if ((c = wmalloc()) == 0)
+		return 0;
+	*c = *n;
+	c->left = c->right = 0;
+	if (c->f)
+		filedup(c->f);
+	if (c->anon)
+		wmanondup(c->anon);
+	if ((n->left && (c->left = wmclone(n->left)) == 0) ||
+		(n->right && (c->right = wmclone(n->right)) == 0)) {
+		wmfreeall(c);
+		return 0;
+	}
+	return c;
+}
+
+// give every node of a tree back to the slab, dropping its file reference
+void wmfreeall(struct map_en *n)
+{
+	if (n == 0)
+		return;
+	wmfreeall(n->left);
+	wmfreeall(n->right);
+	if (n->f)
+		fileclose(n->f);
+	if (n->anon)
+		wmanonput(n->anon);
+	wmfree(n);
+}
+
+
 /********** HELPER METHODS ***********/
 
-// checks if the addr in pg t is valid; 0 if yes, failed ending address if no, -1 if empty
+// checks if the addr in pg t is valid; 0 if yes, failed ending address if no
 int check_valid(uint addr, int length)
 {
 	struct proc* curproc = myproc();
-	for (int i = 0; i < 16; i++) {
-		struct map_en* item = &(curproc->wmaps[i]);
-		if (item->valid == 1) {
-			int botaddr = item->addr;
-			int topaddr = botaddr + item->length;
-			int addrlen = addr + length;
-
-			if ((addr >= botaddr && addr < topaddr) ||
-				(addrlen >= botaddr && addrlen < topaddr) ||
-				(botaddr >= addr && botaddr < addrlen) ||
-				(topaddr >= addr && topaddr < addrlen)) {
-				return PGROUNDUP(topaddr);
+	uint addrlen = addr + PGROUNDUP(length);
+	struct map_en *best = 0;
+
+	// the mapping starting last before addrlen is the only one that can overlap
+	// without an earlier one overlapping too
+	for (struct map_en *n = curproc->wmaps; n; ) {
+		if (n->addr < addrlen) {
+			best = n;
+			n = n->right;
+		} else {
+			n = n->left;
+		}
+	}
+	if (best && wmend(best) > addr) {
+		return wmend(best);
+	}
+	return 0;
+}
+
+// first-fit search for a free range of length bytes between USERBOUNDARY and KERNBASE
+// that starts at a multiple of align; 0 if none
+uint find_free_va(int length, uint align)
+{
+	struct proc* curproc = myproc();
+	uint need = PGROUNDUP(length);
+	// a gap this big holds an aligned range wherever it starts
+	uint va = wmfindgap(curproc->wmaps, need + align - PGSIZE);
+
+	if (va != 0) {
+		return (va + align - 1) & ~(align - 1);
+	}
+
+	// no hole between mappings, try after the last one
+	uint last = USERBOUNDARY;
+	for (struct map_en *n = curproc->wmaps; n; n = n->right) {
+		last = wmend(n);
+	}
+	last = (last + align - 1) & ~(align - 1);
+	if (last + need <= KERNBASE && last + need > last) {
+		return last;
+	}
+	return 0;
+}
+
+/*
+ * Map the faulting page of a file-backed mapping plus up to fawin - 1 pages
+ * after it, reading them all under one inode lock hold. The window doubles
+ * (up to famax) while faults keep landing right after the previous window
+ * and drops back to one page on a non-sequential fault.
+ */
+int fault_around(struct proc* curproc, struct map_en* entry, uint va)
+{
+	struct file* f = entry->f;
+	int shared = entry->flags & MAP_SHARED;
+	int famax = entry->famax > 0 ? entry->famax : WMAP_FAULTAROUND_MAX;
+
+	if (va != entry->nextfault || entry->fawin < 1) {
+		entry->fawin = 1;
+	} else if (entry->fawin > famax / 2) {
+		entry->fawin = famax;
+	} else {
+		entry->fawin = entry->fawin * 2;
+	}
+
+	// count pages rather than bytes, so a large window cannot overflow
+	uint end = wmend(entry);
+	if ((end - va) / PGSIZE > (uint) entry->fawin) {
+		end = va + (uint) entry->fawin * PGSIZE;
+	}
+
+	int mapped = 0;
+	uint next = va;
+	ilock(f->ip);
+	for (uint a = va; a < end; a += PGSIZE) {
+		uint off = a - entry->addr;
+		// never read ahead past end of file, only the faulting page may lie there
+		if (a != va && off >= f->ip->size) {
+			break;
+		}
+		pte_t *pte = walkpgdir(curproc->pgdir, (void *) a, 0);
+		if (pte != 0 && (*pte & PTE_P)) {
+			continue;
+		}
+
+		// shared mappings of the same page all use the page cache's frame
+		char* mem = shared ? pcacheget(f->ip, off) : 0;
+		if (mem == 0) {
+			mem = kalloc();
+			if (mem == 0) {
+				if (a == va) {
+					iunlock(f->ip);
+					return -2;
+				}
+				break;
 			}
+			memset(mem, 0, PGSIZE);
+			readi(f->ip, mem, off, PGSIZE);
+			if (shared && pcacheadd(f->ip, off, mem) != 0) {
+				kfree(mem);
+				if (a == va) {
+					iunlock(f->ip);
+					return -2;
+				}
+				break;
+			}
+		}
+
+		if (mappages(curproc->pgdir, (void *) a, PGSIZE, V2P(mem), PTE_W | PTE_U) != 0) {
+			if (shared)
+				pcacheput(f->ip, off);
+			else
+				kfree(mem);
+			if (a == va) {
+				iunlock(f->ip);
+				return -4;
+			}
+			break;
 		}
+		entry->lpgs++;
+		mapped++;
+		next = a + PGSIZE;
+	}
+	iunlock(f->ip);
+
+	entry->nextfault = next;
+	entry->nfaults++;
+	if (mapped > 1) {
+		entry->nfaultaround += mapped - 1;
+	}
+	return 0;
+}
+
+/*
+ * 4 MiB pages for MAP_HUGE mappings. A block of the mapping that is 4 MiB
+ * aligned and lies entirely inside it is backed by a single PTE_PS directory
+ * entry on its first fault, if khugealloc finds a free run; everything else
+ * uses 4 KiB pages as usual. Unmapping or moving part of a 4 MiB page first
+ * splits it into 4 KiB pages.
+ */
+
+// free the page table covering hva if none of its PTEs is present, so a
+// 4 MiB page can take its directory entry; -1 if it is still in use
+static int pgtab_release(struct proc *p, uint hva)
+{
+	pde_t *pde = &p->pgdir[PDX(hva)];
+
+	if (!(*pde & PTE_P)) {
+		return 0;
+	}
+	if (*pde & PTE_PS) {
+		return -1;
+	}
+	pte_t *pgtab = (pte_t *) P2V(PTE_ADDR(*pde));
+	for (int i = 0; i < NPTENTRIES; i++) {
+		if (pgtab[i] & PTE_P) {
+			return -1;
+		}
+	}
+	*pde = 0;
+	wmflush(p);
+	kfree((char *) pgtab);
+	return 0;
+}
+
+// back the 4 MiB block at hva with one 4 MiB page; -1 if the caller should use 4 KiB pages
+static int huge_fault(struct proc *curproc, struct map_en *entry, uint hva)
+{
+	if (hva < entry->addr || hva + HUGEPGSIZE > wmend(entry)) {
+		return -1;
+	}
+	if (pgtab_release(curproc, hva) != 0) {
+		return -1;
+	}
+	char *mem = khugealloc();
+	if (mem == 0) {
+		return -1;
+	}
+	memset(mem, 0, HUGEPGSIZE);
+	curproc->pgdir[PDX(hva)] = V2P(mem) | PTE_PS | PTE_P | PTE_W | PTE_U;
+
+	entry->lpgs += NPTENTRIES;
+	entry->nfaults++;
+	return 0;
+}
+
+// map a 4 KiB copy of every page of the 4 MiB page src at hva in pgdir
+// returns -1, with nothing left mapped, if out of memory
+static int huge_copy(pde_t *pgdir, uint hva, char *src, int perm)
+{
+	for (uint off = 0; off < HUGEPGSIZE; off += PGSIZE) {
+		char *mem = kalloc();
+		if (mem != 0 && mappages(pgdir, (void *) (hva + off), PGSIZE, V2P(mem), perm) == 0) {
+			memmove(mem, src + off, PGSIZE);
+			continue;
+		}
+		if (mem != 0) {
+			kfree(mem);
+		}
+		for (uint o = 0; o < off; o += PGSIZE) {
+			pte_t *pte = walkpgdir(pgdir, (void *) (hva + o), 0);
+			kfree(P2V(PTE_ADDR(*pte)));
+			*pte = 0;
+		}
+		if (pgdir[PDX(hva)] & PTE_P) {
+			kfree(P2V(PTE_ADDR(pgdir[PDX(hva)])));
+			pgdir[PDX(hva)] = 0;
+		}
+		return -1;
+	}
+	return 0;
+}
+
+// replace the 4 MiB page at hva with 4 KiB pages; -1, leaving it in place, if out of memory
+// a private page is copied; a shared one must stay shared with the processes still
+// mapping it whole, so its own frames are mapped, each holding a reference to it
+static int huge_split(struct proc *p, uint hva, int shared)
+{
+	pde_t pde = p->pgdir[PDX(hva)];
+	char *src = P2V(PTE_ADDR(pde));
+	int perm = PTE_FLAGS(pde) & (PTE_W | PTE_U);
+
+	if (shared && krefcount(src) + NPTENTRIES > 0xffff) {
+		return -1;	// the count would overflow its ushort
+	}
+	p->pgdir[PDX(hva)] = 0;
+	if (shared) {
+		if (mappages(p->pgdir, (void *) hva, HUGEPGSIZE, V2P(src), perm) != 0) {
+			p->pgdir[PDX(hva)] = pde;
+			return -1;
+		}
+		for (uint off = 0; off < HUGEPGSIZE; off += PGSIZE) {
+			kref(src + off);
+		}
+	} else if (huge_copy(p->pgdir, hva, src, perm) != 0) {
+		p->pgdir[PDX(hva)] = pde;
+		return -1;
+	}
+	wmflush(p);
+	khugefree(src);
+	return 0;
+}
+
+// give a forked child the 4 MiB page at hva: the same page if the mapping is
+// shared, otherwise a copy, in 4 KiB pages if no 4 MiB run is free
+static int huge_fork(struct proc *np, struct proc *curproc, uint hva, int shared)
+{
+	pde_t pde = curproc->pgdir[PDX(hva)];
+	char *src = P2V(PTE_ADDR(pde));
+
+	if (shared) {
+		kref(src);
+		np->pgdir[PDX(hva)] = pde;
+		return 0;
+	}
+	char *mem = khugealloc();
+	if (mem == 0) {
+		return huge_copy(np->pgdir, hva, src, PTE_W | PTE_U);
 	}
+	memmove(mem, src, HUGEPGSIZE);
+	np->pgdir[PDX(hva)] = V2P(mem) | PTE_PS | PTE_P | PTE_W | PTE_U;
 	return 0;
 }
 
+// map the page at va of a mapping with a backing object, filling it with
+// zeros if no process sharing the object has touched it yet
+static int anon_fault(struct proc *curproc, struct map_en *entry, uint va)
+{
+	uint off = va - entry->addr;
+
+	acquire(&wmanon.lock);
+	char *mem = pcacheget(entry->anon, off);
+	if (mem == 0) {
+		mem = kalloc();
+		if (mem == 0) {
+			release(&wmanon.lock);
+			return -2;
+		}
+		memset(mem, 0, PGSIZE);
+		if (pcacheadd(entry->anon, off, mem) != 0) {
+			kfree(mem);
+			release(&wmanon.lock);
+			return -2;
+		}
+	}
+	release(&wmanon.lock);
+
+	if (mappages(curproc->pgdir, (void*) va, PGSIZE, V2P(mem), PTE_W | PTE_U) != 0) {
+		pcacheput(entry->anon, off);
+		return -3;
+	}
+	entry->lpgs++;
+	entry->nfaults++;
+	return 0;
+}
 
 // handle page fault, 0 if correct, -1 if not found
 
 int alloc_nu_pte(struct proc* curproc, struct map_en* entry, uint va)
 {
+	if (!(entry->flags & MAP_ANONYMOUS)) {
+		// file-backed mapping
+		return fault_around(curproc, entry, va);
+	}
+	// once shared with another process, never a private 4 MiB page
+	if (entry->anon) {
+		return anon_fault(curproc, entry, va);
+	}
+	if ((entry->flags & MAP_HUGE) && huge_fault(curproc, entry, va & ~(HUGEPGSIZE - 1)) == 0) {
+		return 0;
+	}
 
     char* mem = kalloc();
 	if (mem == 0) {
 		return -2;
 	}
-	if (entry->flags & MAP_ANONYMOUS)
-	{
-		// anonymous mapping
-		if (mappages(curproc->pgdir, (void*) va, PGSIZE, V2P(mem), PTE_W | PTE_U) != 0) {
-			kfree(mem);
-			return -3;
-		}
-		memset(mem, 0, PGSIZE);
-	} else {
-		// file-backed mapping
-        struct file* f = curproc->ofile[entry->fd];
-        
-		ilock(f->ip);
-        readi(f->ip, mem, va - entry->addr, PGSIZE);
-        iunlock(f->ip);
-        
-		if (mappages(curproc->pgdir, (void *) va, PGSIZE, V2P(mem), PTE_W | PTE_U) != 0) {
-            kfree(mem);
-            return -4;
-        }
+	// anonymous mapping
+	if (mappages(curproc->pgdir, (void*) va, PGSIZE, V2P(mem), PTE_W | PTE_U) != 0) {
+		kfree(mem);
+		return -3;
 	}
+	memset(mem, 0, PGSIZE);
 
 	entry->lpgs++;
+	entry->nfaults++;
 	return 0;
 }
 
@@ -90,28 +741,196 @@ int alloc_nu_map(struct proc* curproc, int start, int end, int index)
 
 
 
+// handle a not-present fault at va; check the mapping of the last fault
+// before searching the tree, since faults come in runs over one mapping
 int pf_handler(struct proc* curproc, uint va)
 {
-	// check PGallign
-	/*if (va % PGSIZE != 0) {
-		return -5;
-	}*/
-
-	// find length
-	for (int i = 0; i < 16; i++) {
-		struct map_en* entry = &(curproc->wmaps[i]);
-		int botaddr = entry->addr;
-		int topaddr = botaddr + entry->length;
-		
-		if (va <= topaddr && va >= botaddr) {
-			//found
-			alloc_nu_pte(curproc, entry, PGROUNDDOWN(va));
-			return 0;
+	struct map_en* entry = curproc->wmlast;
+
+	if (entry == 0 || va < entry->addr || va >= wmend(entry)) {
+		if (va < USERBOUNDARY || va >= KERNBASE) {
+			return -1;
+		}
+		entry = wmlookup(curproc, va);
+		if (entry == 0) {
+			return -1;
+		}
+		curproc->wmlast = entry;
+	}
+	return alloc_nu_pte(curproc, entry, PGROUNDDOWN(va));
+}
+
+/*
+ * Write the dirty pages of a shared file mapping in [start, end) back to the
+ * file at their offset in the mapping, clearing their PTE dirty bits. Writes
+ * are packed into log transactions of at most the bytes one MAXOPBLOCKS
+ * transaction can hold, like filewrite, and never extend the file.
+ *
+ * outputs:
+ *  return          number of pages written, FAILED on a write error
+ */
+int writeback_range(struct proc *curproc, struct map_en *entry, uint start, uint end)
+{
+	struct inode *ip = entry->f->ip;
+	int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+	int inop = -1;	// bytes written in the open transaction, -1 if none is open
+	int written = 0;
+	int err = 0;
+
+	if ((entry->flags & MAP_ANONYMOUS) || !(entry->flags & MAP_SHARED) || !entry->f->writable) {
+		return 0;
+	}
+
+	for (uint va = start; va < end && !err; va += PGSIZE) {
+		pte_t *pte = walkpgdir(curproc->pgdir, (void *) va, 0);
+		if (pte == 0 || !(*pte & PTE_P) || !(*pte & PTE_D)) {
+			continue;
+		}
+		*pte &= ~PTE_D;
+		char *mem = P2V(PTE_ADDR(*pte));
+		uint off = va - entry->addr;
+
+		if (inop < 0) {
+			begin_op();
+			ilock(ip);
+			inop = 0;
+		}
+		if (off >= ip->size) {
+			// nothing of this page lies inside the file
+			continue;
+		}
+		int len = ip->size - off < PGSIZE ? ip->size - off : PGSIZE;
+		for (int done = 0; done < len; ) {
+			int n = len - done;
+			if (n > max - inop)
+				n = max - inop;
+			if (writei(ip, mem + done, off + done, n) != n) {
+				err = 1;
+				break;
+			}
+			done += n;
+			inop += n;
+			if (inop == max) {
+				// transaction full, commit it and start the next one
+				iunlock(ip);
+				end_op();
+				begin_op();
+				ilock(ip);
+				inop = 0;
+			}
+		}
+		if (!err) {
+			written++;
+		}
+	}
+	if (inop >= 0) {
+		iunlock(ip);
+		end_op();
+	}
+	// clear cached dirty bits so the next store sets them again
+	wmflush(curproc);
+	return err ? FAILED : written;
+}
+
+// free every present page in [start, end) of a mapping, writing dirty shared file pages back first
+// returns the number of pages freed
+int unmap_range(struct proc *curproc, struct map_en *entry, uint start, uint end)
+{
+	int anon = entry->flags & MAP_ANONYMOUS;
+	int shared = entry->flags & MAP_SHARED;
+	int freed = 0;
+
+	writeback_range(curproc, entry, start, end);
+
+	for (uint i = start; i < end; i += PGSIZE) {
+		pde_t *pde = &curproc->pgdir[PDX(i)];
+		if (*pde & PTE_PS) {
+			uint hva = i & ~(HUGEPGSIZE - 1);
+			if (hva >= start && hva + HUGEPGSIZE <= end) {
+				khugefree(P2V(PTE_ADDR(*pde)));
+				*pde = 0;
+				freed += NPTENTRIES;
+				i = hva + HUGEPGSIZE - PGSIZE;
+				continue;
+			}
+			// only part of the 4 MiB page goes; without memory to split it, leave it for exit
+			if (huge_split(curproc, hva, shared) != 0) {
+				i = hva + HUGEPGSIZE - PGSIZE;
+				continue;
+			}
+		}
+		pte_t *pte = walkpgdir(curproc->pgdir, (void *) i, 0);
+		if (pte != 0 && (*pte & PTE_P)) {
+			uint a = PTE_ADDR(*pte);
+			if (!anon && shared) {
+				// the frame belongs to the page cache, other mappers may still use it
+				pcacheput(entry->f->ip, i - entry->addr);
+			} else if (entry->anon && (kframe(P2V(a))->flags & FRAME_PCACHE)) {
+				pcacheput(entry->anon, i - entry->addr);
+			} else {
+				kfree(P2V(a));
+			}
+			*pte = 0;
+			freed++;
 		}
 	}
-	return -1;
+	wmflush(curproc);
+	return freed;
 }
 
+// move the PTEs of [oldva, oldva + len) to newva without touching page contents;
+// 4 MiB pages move whole if newva keeps them aligned and are split otherwise
+// returns -1 if a page table for the new range cannot be allocated
+int move_range(struct proc *p, uint oldva, uint newva, uint len, int shared)
+{
+	pde_t *pgdir = p->pgdir;
+	int aligned = (newva - oldva) % HUGEPGSIZE == 0;
+
+	for (uint off = 0; off < len; off += PGSIZE) {
+		uint va = oldva + off;
+		if (!(pgdir[PDX(va)] & PTE_PS)) {
+			continue;
+		}
+		uint hva = va & ~(HUGEPGSIZE - 1);
+		if (!aligned || hva < oldva || hva + HUGEPGSIZE > oldva + len ||
+			pgtab_release(p, newva + (hva - oldva)) != 0) {
+			if (huge_split(p, hva, shared) != 0) {
+				return -1;
+			}
+		}
+		off = hva + HUGEPGSIZE - PGSIZE - oldva;
+	}
+
+	// allocate every page table up front so a failure leaves the old range intact
+	for (uint off = 0; off < len; off += PGSIZE) {
+		if (pgdir[PDX(oldva + off)] & PTE_PS) {
+			off += HUGEPGSIZE - PGSIZE;
+			continue;
+		}
+		if (walkpgdir(pgdir, (void *) (newva + off), 1) == 0) {
+			return -1;
+		}
+	}
+
+	for (uint off = 0; off < len; off += PGSIZE) {
+		pde_t *opde = &pgdir[PDX(oldva + off)];
+		if (*opde & PTE_PS) {
+			pgdir[PDX(newva + off)] = *opde;
+			*opde = 0;
+			off += HUGEPGSIZE - PGSIZE;
+			continue;
+		}
+		pte_t *old = walkpgdir(pgdir, (void *) (oldva + off), 0);
+		if (old == 0 || (*old & PTE_P) == 0) {
+			continue;
+		}
+		pte_t *new = walkpgdir(pgdir, (void *) (newva + off), 0);
+		*new = *old;
+		*old = 0;
+	}
+	lcr3(V2P(pgdir));
+	return 0;
+}
 
 // count num pages allocated by a map
 int count_allocated_pages(struct proc *curproc, uint addr, int length) {
@@ -134,12 +953,49 @@ int count_allocated_pages(struct proc *curproc, uint addr, int length) {
 
 /*********** INFO FUNCTIONS ***********/
 
+// in-order walk adding up to MAX_WMMAP_INFO mappings that start at or after from
+static void wminfo_collect(struct map_en *n, uint from, struct wmapinfo *wminfo, int *k)
+{
+	if (n == 0 || *k >= MAX_WMMAP_INFO)
+		return;
+	if (n->addr >= from) {
+		wminfo_collect(n->left, from, wminfo, k);
+		if (*k >= MAX_WMMAP_INFO)
+			return;
+		wminfo->addr[*k] = n->addr;
+		wminfo->length[*k] = n->length;
+		wminfo->n_loaded_pages[*k] = n->lpgs;
+		wminfo->n_faults[*k] = n->nfaults;
+		wminfo->n_faultaround[*k] = n->nfaultaround;
+		(*k)++;
+	}
+	wminfo_collect(n->right, from, wminfo, k);
+}
+
+/*
+ * Paged form of getwmapinfo: fills in the first MAX_WMMAP_INFO mappings that
+ * start at or after `from`, in address order. Callers page through every
+ * mapping by passing one past the last returned address.
+ *
+ * outputs:
+ *  return          number of entries filled in
+ */
+int getwmapinfofrom(struct wmapinfo* wminfo, uint from)
+{
+	struct proc *curproc = myproc();
+	int k = 0;
+
+	memset(wminfo, 0, sizeof(*wminfo));
+    wminfo->total_mmaps = curproc->total_maps;
+	wminfo_collect(curproc->wmaps, from, wminfo, &k);
+	return k;
+}
+
 /*
  * 
  */
 int getwmapinfo(struct wmapinfo* wminfo)
 {
-	struct proc *curproc = myproc();
 /*	struct wmapinfo *wminfo;
     
     // i guess we need it?
@@ -148,18 +1004,7 @@ int getwmapinfo(struct wmapinfo* wminfo)
         return FAILED;
     }
 */
-    wminfo->total_mmaps = curproc->total_maps;
-
-	struct map_en* list = curproc->wmaps;
-
-    // iterate
-    for (int i = 0; i < 16; i++) {
-		if (list[i].valid == 1) {
-			wminfo->addr[i] = list[i].addr;
-			wminfo->length[i] = list[i].length;
-			wminfo->n_loaded_pages[i] = list[i].lpgs;
-		}
-    }
+	getwmapinfofrom(wminfo, 0);
     return 0;
 }
 
@@ -187,6 +1032,20 @@ int getpgdirinfo(struct pgdirinfo* pdinfo) {
     int i = 0;
 
     while (i < MAX_UPAGE_INFO) {
+        pde_t pde = pgdir[PDX(va)];
+
+        // a 4 MiB page has no page table; report each of its 4 KiB pieces
+        if ((pde & PTE_P) && (pde & PTE_PS)) {
+            if (pde & PTE_U) {
+                pdinfo->va[i] = va;
+                pdinfo->pa[i] = PTE_ADDR(pde) + (va & (HUGEPGSIZE - 1));
+                pdinfo->n_upages++;
+                i++;
+            }
+            va += PGSIZE;
+            continue;
+        }
+
         pte_t *pte = walkpgdir(pgdir, (void *)va, 0);
 
         if (pte != 0 && (*pte & PTE_P) != 0 && (*pte & PTE_U) != 0) {
@@ -209,7 +1068,7 @@ int getpgdirinfo(struct pgdirinfo* pdinfo) {
 /*
  * EDIT: functionality of system call wmap goes here
  * Iteratively make calls to physical memory (per page) to obtain addresses to add to the page table of a specific process
- * implementation is considered "lazy". 16 max mem allocs.
+ * implementation is considered "lazy". mappings are limited only by kernel memory.
  *
  * inputs:
  *  uint addr       virtual address
@@ -259,6 +1118,10 @@ uint wmap(uint addr, int length, int flags, int fd)
         return -2;
 		//return FAILED;
     }
+	// 4 MiB pages are only for anonymous memory
+	if ((flags & MAP_HUGE) && !(flags & MAP_ANONYMOUS)) {
+		return FAILED;
+	}
 
     uint va = 0;
 
@@ -277,23 +1140,9 @@ uint wmap(uint addr, int length, int flags, int fd)
 		va = addr;
 
     } else {
-        if(curproc->total_maps > 15) {
-            return FAILED;
-        }
-
-		int found = 0;
         // loop thru pg t to get available space
-		int t_va = USERBOUNDARY;
-		while(t_va + length < KERNBASE) {
-            int valid = check_valid(t_va, length);
-			if (valid == 0) {
-				va = t_va;
-				found = 1;
-				break;
-			}
-			t_va = valid;
-		}
-		if (!found)
+		va = find_free_va(length, (flags & MAP_HUGE) ? HUGEPGSIZE : PGSIZE);
+		if (va == 0)
 			return -7;
 	}
     
@@ -302,7 +1151,7 @@ uint wmap(uint addr, int length, int flags, int fd)
     if(flags & MAP_ANONYMOUS) {
         // do nothing
     } else {
-		if (fd <= 0)
+		if (fd <= 0 || fd >= NOFILE || curproc->ofile[fd] == 0)
 		{
 			return -5;
 		}
@@ -315,23 +1164,18 @@ uint wmap(uint addr, int length, int flags, int fd)
 	}
 
     /* UPDATE MAP TRACKER */
-	struct map_en* cme = curproc->wmaps;	
-
-	for (int i = 0; i < 16; i++)
-    {
-        if (cme[i].valid == 0)
-        {
-            // place it here
-            cme[i].valid = 1;
-			cme[i].addr = va;
-			cme[i].length = length;
-			cme[i].lpgs = 0;
-			cme[i].flags = flags;
-			cme[i].fd = fd;
-			curproc->total_maps++;
-			break;
-        }
-    }	
+	struct map_en* cme = wmalloc();
+	if (cme == 0) {
+		if (f)
+			fileclose(f);
+		return FAILED;
+	}
+	cme->addr = va;
+	cme->length = length;
+	cme->lpgs = 0;
+	cme->flags = flags;
+	cme->f = f;
+	wminsert(curproc, cme);
 
     return va;
 }
@@ -353,55 +1197,244 @@ int wunmap(uint addr)
 		return FAILED;
 	}
 
-    // adjust linked list
-	int free_len = 0;
-    struct map_en* list = curproc->wmaps;
-	int flags = 0;
-	int found = 0;
-	int fd = 0;
-
-    for (int i = 0; i < 16; i++) {
-        if (list[i].addr == addr) {
-			free_len = list[i].length;
-			flags = list[i].flags;
-            fd = list[i].fd;
-			list[i].valid = 0;  // Free the memory occupied by the removed node
-            curproc->total_maps--;
-			found = 1;
-            break;
-        }
-    }
-	if (found == 0) {
+    // adjust mapping tree
+	struct map_en* entry = wmlookup(curproc, addr);
+	if (entry == 0 || entry->addr != addr) {
 		return -1;
 	}
 
     // Go into pg t, if page is present and valid, remove
-	int anon = flags & MAP_ANONYMOUS;
-	int shared = flags & MAP_SHARED;
-	for (int i = addr; i < addr + free_len; i += PGSIZE) {
-		pte_t *pte = walkpgdir(myproc()->pgdir, (void *) i, 0);
-		if (pte != 0) {
-			uint a = PTE_ADDR(*pte);
-			if (!anon && shared) {
-				struct file* f = curproc->ofile[fd];
-				filewrite(f, P2V(a), PGSIZE);
-			}
+	unmap_range(curproc, entry, addr, wmend(entry));
 
-			kfree(P2V(a));		
-			*pte = 0;
-		}
+	wmremove(curproc, entry);
+	if (entry->f)
+		fileclose(entry->f);
+	if (entry->anon)
+		wmanonput(entry->anon);
+	wmfree(entry);
+
+	return SUCCESS;
+}
+
+/*
+ * Resize the mapping that starts at oldaddr and is exactly oldsize bytes long.
+ *
+ * Shrinking frees the tail pages in place. Growing extends the mapping in place
+ * when the pages after it are not used by another mapping; otherwise, if
+ * MREMAP_MAYMOVE is set, the mapping is relocated by moving its PTEs to a free
+ * range, so loaded pages keep their physical frames and nothing is copied.
+ *
+ * outputs:
+ *  return          new starting address, FAILED on error
+ */
+uint wremap(uint oldaddr, int oldsize, int newsize, int flags)
+{
+	struct proc *curproc = myproc();
+	struct map_en *entry = 0;
+
+	/* CATCH ERROR */
+	if (oldaddr % PGSIZE != 0 || oldsize <= 0 || newsize <= 0) {
+		return FAILED;
 	}
-    
+	if (flags & ~MREMAP_MAYMOVE) {
+		return FAILED;
+	}
+
+	entry = wmlookup(curproc, oldaddr);
+	if (entry == 0 || entry->addr != oldaddr || entry->length != oldsize) {
+		return FAILED;
+	}
+
+	uint oldend = oldaddr + PGROUNDUP(oldsize);
+	uint newend = oldaddr + PGROUNDUP(newsize);
+
+	// shrink in place
+	if (newend <= oldend) {
+		entry->lpgs -= unmap_range(curproc, entry, newend, oldend);
+		wmremove(curproc, entry);
+		entry->length = newsize;
+		wminsert(curproc, entry);
+		return oldaddr;
+	}
+
+	// grow in place if the pages right after the mapping are free
+	if (newend <= KERNBASE && newend > oldaddr &&
+		check_valid(oldend, newend - oldend) == 0) {
+		wmremove(curproc, entry);
+		entry->length = newsize;
+		wminsert(curproc, entry);
+		return oldaddr;
+	}
+
+	if (!(flags & MREMAP_MAYMOVE)) {
+		return FAILED;
+	}
+
+	// relocate: the old range still counts as used, so the new one never overlaps it
+	uint va = find_free_va(newsize, (entry->flags & MAP_HUGE) ? HUGEPGSIZE : PGSIZE);
+	if (va == 0) {
+		return FAILED;
+	}
+	if (move_range(curproc, oldaddr, va, oldend - oldaddr, entry->flags & MAP_SHARED) != 0) {
+		return FAILED;
+	}
+	wmremove(curproc, entry);
+	entry->addr = va;
+	entry->length = newsize;
+	wminsert(curproc, entry);
+
+	return va;
+}
+
+/*
+ * Set the largest fault-around window, in pages, for the mapping containing addr.
+ * A window of 1 maps only the faulting page; 0 restores WMAP_FAULTAROUND_MAX.
+ */
+int wmadvise(uint addr, int window)
+{
+	struct map_en *entry = wmlookup(myproc(), addr);
 
+	if (entry == 0 || window < 0) {
+		return FAILED;
+	}
+	entry->famax = window;
+	// start the next window afresh from one page
+	entry->fawin = 1;
+	entry->nextfault = 0;
 	return SUCCESS;
 }
 
+// unmap every mapping of p before its page table goes away, so shared
+// file pages are written back and released from the page cache
+void wmunmapall(struct proc *p)
+{
+	while (p->wmaps) {
+		struct map_en *entry = p->wmaps;
+		unmap_range(p, entry, entry->addr, wmend(entry));
+		wmremove(p, entry);
+		if (entry->f)
+			fileclose(entry->f);
+		if (entry->anon)
+			wmanonput(entry->anon);
+		wmfree(entry);
+	}
+}
 
-// Implementation of mremap system call
-uint wremap(uint oldaddr, int oldsize, int newsize, int flags)
+/*
+ * Give a forked child np the loaded pages of its parent's mappings; np->wmaps
+ * must already be a clone of the parent's tree. MAP_SHARED pages stay shared
+ * and writable in both processes. A shared anonymous mapping gets a backing
+ * object on its first fork and its loaded pages go into the page cache under
+ * it, so pages neither process has touched yet are faulted in lazily to the
+ * same frame; only its untouched 4 MiB blocks are loaded now, since a 4 MiB
+ * page cannot be cached. MAP_PRIVATE pages are mapped read-only in both and
+ * copied by cowfault on the first write from either side, except 4 MiB
+ * pages, which the child gets a copy of right away.
+ *
+ * outputs:
+ *  return          0, -1 if out of memory
+ */
+int wmfork(struct proc *np, struct proc *curproc)
 {
-    // Your implementation here
+	// walk the parent's mappings in address order
+	for (struct map_en *entry = wmnext(curproc, 0); entry; entry = wmnext(curproc, wmend(entry))) {
+		struct map_en *child = wmlookup(np, entry->addr);
+		int shared = entry->flags & MAP_SHARED;
+		int anon = entry->flags & MAP_ANONYMOUS;
+
+		child->lpgs = 0;
+		if (shared && anon && entry->anon == 0) {
+			if (entry->flags & MAP_HUGE) {
+				uint hva = (entry->addr + HUGEPGSIZE - 1) & ~(HUGEPGSIZE - 1);
+				for (; hva >= entry->addr && hva + HUGEPGSIZE <= wmend(entry); hva += HUGEPGSIZE) {
+					if (!(curproc->pgdir[PDX(hva)] & PTE_PS))
+						huge_fault(curproc, entry, hva);
+				}
+			}
+			if ((entry->anon = wmanonalloc()) == 0)
+				return -1;
+		}
+		if (entry->anon && child->anon == 0)
+			child->anon = wmanondup(entry->anon);
+
+		for (uint va = entry->addr; va < wmend(entry); va += PGSIZE) {
+			pte_t *pte = walkpgdir(curproc->pgdir, (void *) va, 0);
+			if (curproc->pgdir[PDX(va)] & PTE_PS) {
+				if (huge_fork(np, curproc, va, shared) != 0)
+					return -1;
+				child->lpgs += NPTENTRIES;
+				va += HUGEPGSIZE - PGSIZE;
+				continue;
+			}
+			if (pte == 0 || !(*pte & PTE_P)) {
+				continue;
+			}
+
+			uint pa = PTE_ADDR(*pte);
+			uint flags = PTE_FLAGS(*pte) & ~PTE_D;
+			// a piece of a split shared 4 MiB page is shared as it is, not cached
+			int piece = kframe(P2V(pa))->flags & FRAME_HUGE;
+			if (shared && !anon) {
+				pcacheget(entry->f->ip, va - entry->addr);
+			} else if (entry->anon && !piece) {
+				// loaded before the object existed: hand the frame to the cache
+				if (!(kframe(P2V(pa))->flags & FRAME_PCACHE) &&
+					pcacheadd(entry->anon, va - entry->addr, P2V(pa)) != 0)
+					return -1;
+				kref(P2V(pa));
+			} else {
+				if (!shared && (*pte & PTE_W)) {
+					*pte = (*pte & ~PTE_W) | PTE_COW;
+					flags = (flags & ~PTE_W) | PTE_COW;
+				}
+				kref(P2V(pa));
+			}
+			if (mappages(np->pgdir, (void *) va, PGSIZE, pa, flags) != 0) {
+				if (shared && !anon)
+					pcacheput(entry->f->ip, va - entry->addr);
+				else if (entry->anon && !piece)
+					pcacheput(entry->anon, va - entry->addr);
+				else
+					kfree(P2V(pa));
+				return -1;
+			}
+			child->lpgs++;
+		}
+	}
 	return 0;
 }
 
+/*
+ * Flush the dirty pages of every shared file mapping in [addr, addr + length)
+ * to their files without unmapping them.
+ *
+ * outputs:
+ *  return          SUCCESS, FAILED if addr is not page aligned or a write fails
+ */
+int wmsync(uint addr, int length)
+{
+	struct proc *curproc = myproc();
+	uint end = addr + length;
+
+	if (addr % PGSIZE != 0 || length <= 0 || end < addr) {
+		return FAILED;
+	}
 
+	for (uint va = addr; va < end; ) {
+		struct map_en *entry = wmlookup(curproc, va);
+		if (entry == 0) {
+			// jump over the gap to the next mapping
+			entry = wmnext(curproc, va);
+			if (entry == 0 || entry->addr >= end) {
+				break;
+			}
+			va = entry->addr;
+		}
+		uint stop = wmend(entry) < end ? wmend(entry) : end;
+		if (writeback_range(curproc, entry, va, stop) < 0) {
+			return FAILED;
+		}
+		va = stop;
+	}
+	return SUCCESS;
+}
@@ -1,15 +1,29 @@
+#include "param.h"
+
 // Flags for wmap
 #define MAP_PRIVATE 0x0001
 #define MAP_SHARED 0x0002
 #define MAP_ANONYMOUS 0x0004
 #define MAP_FIXED 0x0008
+#define MAP_HUGE 0x0010      // back 4 MiB-aligned blocks of an anonymous mapping with 4 MiB pages
 // Flags for remap
 #define MREMAP_MAYMOVE 0x1
 
+// Default cap, in pages, on how far a file-backed fault reads ahead.
+// `wmadvise` overrides it per mapping; a window of 1 disables fault-around.
+#define WMAP_FAULTAROUND_MAX 16
+
 // When any system call fails, returns -1
 #define FAILED -1
 #define SUCCESS 0
 
+// for `getpfstat`
+// bucket i counts faults that took [2^i, 2^(i+1)) TSC cycles
+struct pfstat {
+    uint hist[NPFHIST];      // not-present faults filled in from a wmap
+    uint cowhist[NPFHIST];   // write faults on copy-on-write pages
+};
+
 // for `getpgdirinfo`
 #define MAX_UPAGE_INFO 32
 struct pgdirinfo {
@@ -25,4 +39,6 @@ struct wmapinfo {
     int addr[MAX_WMMAP_INFO];           // Starting address of mapping
     int length[MAX_WMMAP_INFO];         // Size of mapping
     int n_loaded_pages[MAX_WMMAP_INFO]; // Number of pages physically loaded into memory
+    int n_faults[MAX_WMMAP_INFO];       // Number of page faults taken on the mapping
+    int n_faultaround[MAX_WMMAP_INFO];  // Pages mapped ahead of a fault without trapping
 };
\ No newline at end of file
@@ -130,6 +130,36 @@ xchg(volatile uint *addr, uint newval)
   return result;
 }
 
+// Atomically replace *addr with newval if it still holds
+// expected. Returns the value *addr held before.
+static inline ushort
+cmpxchgw(volatile ushort *addr, ushort expected, ushort newval)
+{
+  ushort result;
+
+  asm volatile("lock; cmpxchgw %2, %1" :
+               "=a" (result), "+m" (*addr) :
+               "r" (newval), "0" (expected) :
+               "cc");
+  return result;
+}
+
+static inline void
+atomic_incw(volatile ushort *addr)
+{
+  asm volatile("lock; incw %0" : "+m" (*addr) : : "cc");
+}
+
+// Low 32 bits of the time-stamp counter.
+static inline uint
+rdtsc(void)
+{
+  uint lo, hi;
+
+  asm volatile("rdtsc" : "=a" (lo), "=d" (hi));
+  return lo;
+}
+
 static inline uint
 rcr2(void)
 {
@@ -0,0 +1,194 @@
+// Atomic operations and spin-based synchronization for user
+// programs. Everything here is inline and never enters the
+// kernel, except that a thread that has waited long at a
+// ubarrier goes to sleep on it. Include after user.h.
+
+#ifndef __ATOMIC_H__
+#define __ATOMIC_H__
+
+#include "x86.h"
+
+// Keep the compiler from moving memory accesses across this.
+static inline void
+atomic_barrier(void)
+{
+  asm volatile("" : : : "memory");
+}
+
+// Also keep the CPU from moving a load ahead of an earlier
+// store, the one reordering x86 does.
+static inline void
+atomic_fence(void)
+{
+  __sync_synchronize();
+}
+
+// Add v to *p and return what *p held before.
+static inline uint
+atomic_fetch_add(volatile uint *p, uint v)
+{
+  asm volatile("lock; xaddl %0, %1" :
+               "+r" (v), "+m" (*p) :
+               :
+               "cc", "memory");
+  return v;
+}
+
+// Set *p to newval if it holds expected. Returns the value
+// *p held before, so success is a return of expected.
+static inline uint
+atomic_cas(volatile uint *p, uint expected, uint newval)
+{
+  return cmpxchg(p, expected, newval);
+}
+
+// Set *p to 1 and return what it held before.
+static inline uint
+atomic_tas(volatile uint *p)
+{
+  uint old = xchg(p, 1);
+
+  atomic_barrier();
+  return old;
+}
+
+// Ticket spinlock: first come, first served.
+typedef struct {
+  volatile uint next;   // ticket for the next arrival
+  volatile uint owner;  // ticket being served
+} ticketlock;
+
+static inline void
+ticket_init(ticketlock *l)
+{
+  l->next = 0;
+  l->owner = 0;
+}
+
+static inline void
+ticket_acquire(ticketlock *l)
+{
+  uint me = atomic_fetch_add(&l->next, 1);
+
+  while(l->owner != me)
+    pause();
+  atomic_barrier();
+}
+
+static inline void
+ticket_release(ticketlock *l)
+{
+  atomic_barrier();
+  l->owner++;  // only the holder writes owner
+}
+
+// Reader-writer spinlock. Any number of readers, or one
+// writer; a waiting writer keeps new readers out, so a steady
+// stream of readers cannot starve it.
+#define RW_WRITER  1  // held by a writer
+#define RW_PENDING 2  // a writer is waiting
+#define RW_READER  4  // added per reader
+
+typedef struct {
+  volatile uint state;
+} rwlock;
+
+static inline void
+rw_init(rwlock *l)
+{
+  l->state = 0;
+}
+
+static inline void
+rw_rlock(rwlock *l)
+{
+  uint s;
+
+  for(;;){
+    s = l->state;
+    if((s & (RW_WRITER|RW_PENDING)) == 0 &&
+       atomic_cas(&l->state, s, s + RW_READER) == s)
+      return;
+    pause();
+  }
+}
+
+static inline void
+rw_runlock(rwlock *l)
+{
+  atomic_fetch_add(&l->state, -RW_READER);
+}
+
+static inline void
+rw_wlock(rwlock *l)
+{
+  uint s;
+
+  for(;;){
+    s = l->state;
+    if((s & ~RW_PENDING) == 0){
+      if(atomic_cas(&l->state, s, RW_WRITER) == s)
+        return;
+    } else if((s & RW_PENDING) == 0)
+      atomic_cas(&l->state, s, s | RW_PENDING);
+    pause();
+  }
+}
+
+static inline void
+rw_wunlock(rwlock *l)
+{
+  // Leaves RW_PENDING for any writer that set it meanwhile.
+  atomic_fetch_add(&l->state, -RW_WRITER);
+}
+
+// Barrier for n threads, reusable round after round. Waiters
+// spin for a while, then sleep in futex_wait on gen.
+#define UBARRIER_SPIN 10000
+
+typedef struct {
+  uint n;                  // threads per round
+  volatile uint count;     // arrived this round
+  volatile uint gen;       // round number
+  volatile uint sleepers;  // threads in or entering futex_wait
+} ubarrier;
+
+static inline void
+ubarrier_init(ubarrier *b, uint n)
+{
+  b->n = n;
+  b->count = 0;
+  b->gen = 0;
+  b->sleepers = 0;
+}
+
+// Wait for all n threads to arrive. Returns 1 in exactly one
+// of them, the last to arrive, and 0 in the rest.
+static inline int
+ubarrier_wait(ubarrier *b)
+{
+  uint gen = b->gen;
+  int i;
+
+  if(atomic_fetch_add(&b->count, 1) == b->n - 1){
+    b->count = 0;
+    atomic_fetch_add(&b->gen, 1);
+    // Any waiter that counted itself before this bump of gen
+    // is seen here; one that counts itself later finds gen
+    // already moved when futex_wait checks it.
+    if(b->sleepers)
+      futex_wake(&b->gen, b->sleepers);
+    return 1;
+  }
+  for(i = 0; i < UBARRIER_SPIN && b->gen == gen; i++)
+    pause();
+  while(b->gen == gen){
+    atomic_fetch_add(&b->sleepers, 1);
+    futex_wait(&b->gen, gen);
+    atomic_fetch_add(&b->sleepers, -1);
+  }
+  atomic_barrier();
+  return 0;
+}
+
+#endif
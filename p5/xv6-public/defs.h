@@ -1,8 +1,9 @@
-#include "mutex.h"
 
 struct buf;
 struct context;
 struct file;
+struct frame;
+struct kmemstat;
 struct inode;
 struct pipe;
 struct proc;
@@ -70,6 +71,11 @@ char*           kalloc(void);
 void            kfree(char*);
 void            kinit1(void*, void*);
 void            kinit2(void*, void*);
+void            kref(char*);
+int             kunref(char*);
+int             krefcount(char*);
+struct frame*   kframe(char*);
+int             kmemstat(struct kmemstat*);
 
 // kbd.c
 void            kbdintr(void);
@@ -81,6 +87,8 @@ extern volatile uint*    lapic;
 void            lapiceoi(void);
 void            lapicinit(void);
 void            lapicstartap(uchar, uint);
+void            lapictimer(int);
+void            lapicsendipi(uchar, int);
 void            microdelay(int);
 
 // log.c
@@ -110,6 +118,7 @@ void            exit(void);
 int             fork(void);
 int             clone(void(*)(void*), void*, void*);
 int             growproc(int);
+int             join(int, void**);
 int             kill(int);
 struct cpu*     mycpu(void);
 struct proc*    myproc();
@@ -122,7 +131,16 @@ void            sleep(void*, struct spinlock*);
 void            userinit(void);
 int             wait(void);
 void            wakeup(void*);
-void            sleep_proc_notify(void);
+void            wakeproc(struct proc*, void*);
+void            piwait(int);
+int             spinowner(int, volatile uint*, uint);
+void            pihandoff(struct proc*, void*, struct proc*);
+void            setnice(int);
+int             sleepuntil(uint);
+void            timerexpire(void);
+void            schedtick(void);
+int             setsched(int);
+int             setaffinity(int, uint);
 void            yield(void);
 
 // swtch.S
@@ -186,13 +204,23 @@ void            inituvm(pde_t*, char*, uint);
 int             loaduvm(pde_t*, char*, struct inode*, uint, uint);
 pde_t*          copyuvm(pde_t*, uint);
 void            switchuvm(struct proc*);
+void            settls(struct proc*);
+void            vmspaceinit(void);
+struct vmspace* vmcreate(pde_t*, uint);
+struct vmspace* vmdup(struct vmspace*);
+void            vmput(struct vmspace*);
+void            idleuvm(void);
+void            tlbflushintr(void);
 void            switchkvm(void);
 int             copyout(pde_t*, uint, void*, uint);
 void            clearpteu(pde_t *pgdir, char *uva);
 
 // mutex.c
-void			macquire(mutex*);
-void			mrelease(mutex*);
+void            futexinit(void);
+int             futex_wait(uint, uint);
+int             futex_waitpi(uint, uint, int);
+int             futex_wake(uint, int);
+int             futex_unlockpi(uint);
 int				nice(int);
 
 
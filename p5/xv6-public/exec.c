@@ -16,7 +16,8 @@ exec(char *path, char **argv)
   struct elfhdr elf;
   struct inode *ip;
   struct proghdr ph;
-  pde_t *pgdir, *oldpgdir;
+  pde_t *pgdir;
+  struct vmspace *vm, *oldvm;
   struct proc *curproc = myproc();
 
   begin_op();
@@ -93,14 +94,19 @@ exec(char *path, char **argv)
       last = s+1;
   safestrcpy(curproc->name, last, sizeof(curproc->name));
 
-  // Commit to the user image.
-  oldpgdir = curproc->pgdir;
-  curproc->pgdir = pgdir;
-  curproc->sz = sz;
+  // Commit to the user image, leaving any other threads
+  // in the old one.
+  if((vm = vmcreate(pgdir, sz)) == 0)
+    goto bad;
+  oldvm = curproc->vm;
+  curproc->vm = vm;
   curproc->tf->eip = elf.entry;  // main
   curproc->tf->esp = sp;
+  curproc->tf->gs = 0;
+  curproc->tls = 0;
+  curproc->ustack = 0;
   switchuvm(curproc);
-  freevm(oldpgdir);
+  vmput(oldvm);
   return 0;
 
  bad:
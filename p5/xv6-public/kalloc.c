@@ -7,7 +7,10 @@
 #include "param.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "x86.h"
 #include "spinlock.h"
+#include "proc.h"
+#include "kalloc.h"
 
 void freerange(void *vstart, void *vend);
 extern char end[]; // first address after kernel loaded from ELF file
@@ -17,12 +20,42 @@ struct run {
   struct run *next;
 };
 
+// Once kinit2 is done, every CPU allocates from and frees to
+// a private list, so the common case never touches kmem.lock.
+// Pages move between a CPU's list and the global pool KBATCH
+// at a time; a CPU that finds the pool empty steals half of
+// another CPU's list. A CPU keeps at most KCPUMAX pages.
+#define KBATCH   32
+#define KCPUMAX  (2*KBATCH)
+
+struct kcpu {
+  struct spinlock lock;    // held by the owner, or by a thief
+  struct run *freelist;
+  int nfree;
+  // Written only by the owning CPU.
+  uint hit;                // kalloc found a page on freelist
+  uint miss;               // freelist was empty
+  uint steal;              // ... and was refilled from another CPU
+};
+
 struct {
   struct spinlock lock;
   int use_lock;
   struct run *freelist;
+  int nfree;
+  struct kcpu cpu[NCPU];
 } kmem;
 
+// Per-frame metadata, indexed by physical page number.
+// ref is updated with atomic instructions, so sharers
+// never need kmem.lock to take or drop a reference.
+// flags are plain loads and stores, made only by the
+// frame's single owner: kfree sets FRAME_FREE once ref
+// has reached 0 and kalloc clears it before handing the
+// page out, and the page table's owner alone sets and
+// clears FRAME_PGDIR.
+struct frame frames[PHYSTOP/PGSIZE];
+
 // Initialization happens in two phases.
 // 1. main() calls kinit1() while still using entrypgdir to place just
 // the pages mapped by entrypgdir on free list.
@@ -31,7 +64,11 @@ struct {
 void
 kinit1(void *vstart, void *vend)
 {
+  struct kcpu *c;
+
   initlock(&kmem.lock, "kmem");
+  for(c = kmem.cpu; c < &kmem.cpu[NCPU]; c++)
+    initlock(&c->lock, "kcpu");
   kmem.use_lock = 0;
   freerange(vstart, vend);
 }
@@ -51,46 +88,243 @@ freerange(void *vstart, void *vend)
   for(; p + PGSIZE <= (char*)vend; p += PGSIZE)
     kfree(p);
 }
+
+// Metadata for the frame holding kernel address v.
+struct frame*
+kframe(char *v)
+{
+  if((uint)v % PGSIZE || v < end || V2P(v) >= PHYSTOP)
+    panic("kframe");
+  return &frames[V2P(v)/PGSIZE];
+}
+
+// Take another reference to the allocated page at v,
+// e.g. for a second page table entry that maps it.
+void
+kref(char *v)
+{
+  struct frame *f = kframe(v);
+
+  if(f->ref == 0)
+    panic("kref free page");
+  atomic_incw(&f->ref);
+}
+
+// Drop a reference to the page at v without freeing it.
+// Returns the references left; at 0 the caller owns the
+// page alone and must eventually kfree it.
+int
+kunref(char *v)
+{
+  struct frame *f = kframe(v);
+  ushort r;
+
+  do {
+    r = f->ref;
+    if(r == 0)
+      panic("kunref");
+  } while(cmpxchgw(&f->ref, r, r - 1) != r);
+  return r - 1;
+}
+
+// Number of references to the page at v.
+int
+krefcount(char *v)
+{
+  return kframe(v)->ref;
+}
+
+// Detach up to n pages from the front of *fl and
+// return them as a chain of *cnt pages.
+static struct run*
+kdetach(struct run **fl, int *nfree, int n, int *cnt)
+{
+  struct run *head, *r;
+  int i;
+
+  head = *fl;
+  r = 0;
+  for(i = 0; i < n && *fl; i++){
+    r = *fl;
+    *fl = r->next;
+  }
+  if(r)
+    r->next = 0;
+  *nfree -= i;
+  *cnt = i;
+  return i ? head : 0;
+}
+
+// Push a chain of cnt pages onto *fl.
+static void
+kattach(struct run **fl, int *nfree, struct run *chain, int cnt)
+{
+  struct run *r;
+
+  if(chain == 0)
+    return;
+  for(r = chain; r->next; r = r->next)
+    ;
+  r->next = *fl;
+  *fl = chain;
+  *nfree += cnt;
+}
+
+// Find pages for c, whose list is empty: a batch from the
+// global pool or else half of some other CPU's list.
+// Called with interrupts off and without c->lock, so two
+// CPUs stealing from each other cannot deadlock.
+static struct run*
+krefill(struct kcpu *c, int *cnt)
+{
+  struct kcpu *v;
+  struct run *chain;
+
+  acquire(&kmem.lock);
+  chain = kdetach(&kmem.freelist, &kmem.nfree, KBATCH, cnt);
+  release(&kmem.lock);
+  if(chain)
+    return chain;
+
+  for(v = kmem.cpu; v < &kmem.cpu[ncpu]; v++){
+    if(v == c)
+      continue;
+    acquire(&v->lock);
+    chain = kdetach(&v->freelist, &v->nfree, (v->nfree + 1) / 2, cnt);
+    release(&v->lock);
+    if(chain){
+      c->steal++;
+      return chain;
+    }
+  }
+  return 0;
+}
+
 //PAGEBREAK: 21
-// Free the page of physical memory pointed at by v,
-// which normally should have been returned by a
+// Drop a reference to the page of physical memory pointed
+// at by v, which normally should have been returned by a
 // call to kalloc().  (The exception is when
 // initializing the allocator; see kinit above.)
+// The page is freed when its last reference goes away.
 void
 kfree(char *v)
 {
-  struct run *r;
+  struct frame *f = kframe(v);
+  struct kcpu *c;
+  struct run *r, *chain, **pr;
+  ushort ref;
+  int n;
 
-  if((uint)v % PGSIZE || v < end || V2P(v) >= PHYSTOP)
-    panic("kfree");
+  // A page with one reference, or none (see kunref
+  // and freerange), is freed; otherwise just drop one.
+  for(;;){
+    ref = f->ref;
+    if(ref <= 1){
+      if(cmpxchgw(&f->ref, ref, 0) == ref)
+        break;
+    } else if(cmpxchgw(&f->ref, ref, ref - 1) == ref){
+      return;
+    }
+  }
+  if(f->flags & FRAME_FREE)
+    panic("kfree: double free");
+  if(f->flags & FRAME_PGDIR)
+    panic("kfree: page still in use");
 
   // Fill with junk to catch dangling refs.
   memset(v, 1, PGSIZE);
 
-  if(kmem.use_lock)
-    acquire(&kmem.lock);
+  f->flags = FRAME_FREE;
   r = (struct run*)v;
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  if(kmem.use_lock)
+  if(!kmem.use_lock){
+    r->next = kmem.freelist;
+    kmem.freelist = r;
+    kmem.nfree++;
+    return;
+  }
+
+  pushcli();
+  c = &kmem.cpu[cpuid()];
+  acquire(&c->lock);
+  r->next = c->freelist;
+  c->freelist = r;
+  c->nfree++;
+  chain = 0;
+  if(c->nfree > KCPUMAX){
+    // Keep the KBATCH most recently freed, cache-warm pages.
+    pr = &c->freelist;
+    for(n = 0; n < KBATCH; n++)
+      pr = &(*pr)->next;
+    chain = kdetach(pr, &c->nfree, c->nfree - KBATCH, &n);
+  }
+  release(&c->lock);
+  if(chain){
+    acquire(&kmem.lock);
+    kattach(&kmem.freelist, &kmem.nfree, chain, n);
     release(&kmem.lock);
+  }
+  popcli();
 }
 
 // Allocate one 4096-byte page of physical memory.
 // Returns a pointer that the kernel can use.
 // Returns 0 if the memory cannot be allocated.
+// The page starts with one reference and no flags.
 char*
 kalloc(void)
 {
-  struct run *r;
+  struct kcpu *c;
+  struct run *r, *chain;
+  int n;
 
-  if(kmem.use_lock)
-    acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  if(kmem.use_lock)
-    release(&kmem.lock);
+  if(!kmem.use_lock){
+    r = kmem.freelist;
+    if(r){
+      kmem.freelist = r->next;
+      kmem.nfree--;
+    }
+  } else {
+    pushcli();
+    c = &kmem.cpu[cpuid()];
+    acquire(&c->lock);
+    if(c->freelist){
+      c->hit++;
+    } else {
+      c->miss++;
+      release(&c->lock);
+      chain = krefill(c, &n);
+      acquire(&c->lock);
+      kattach(&c->freelist, &c->nfree, chain, n);
+    }
+    r = c->freelist;
+    if(r){
+      c->freelist = r->next;
+      c->nfree--;
+    }
+    release(&c->lock);
+    popcli();
+  }
+  if(r){
+    frames[V2P(r)/PGSIZE].ref = 1;
+    frames[V2P(r)/PGSIZE].flags = 0;
+  }
   return (char*)r;
 }
 
+// Copy each CPU's allocator counters to st[0..ncpu-1]
+// and return ncpu.
+int
+kmemstat(struct kmemstat *st)
+{
+  struct kcpu *c;
+  int i;
+
+  for(i = 0; i < ncpu; i++){
+    c = &kmem.cpu[i];
+    st[i].hit = c->hit;
+    st[i].miss = c->miss;
+    st[i].steal = c->steal;
+    st[i].nfree = c->nfree;
+  }
+  return ncpu;
+}
@@ -0,0 +1,13 @@
+// Per-CPU page allocator statistics, see kmemstat().
+
+#ifndef __KALLOC_H__
+#define __KALLOC_H__
+
+struct kmemstat {
+  uint hit;     // kalloc calls served from the CPU's own free list
+  uint miss;    // calls that had to refill it
+  uint steal;   // refills taken from another CPU's list
+  int nfree;    // pages on the CPU's free list now
+};
+
+#endif
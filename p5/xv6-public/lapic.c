@@ -97,6 +97,28 @@ lapicinit(void)
   lapicw(TPR, 0);
 }
 
+// Mask or unmask this CPU's timer interrupt. An idle CPU
+// masks it to halt until some other interrupt arrives.
+void
+lapictimer(int on)
+{
+  if(!lapic)
+    return;
+  lapicw(TIMER, (on ? 0 : MASKED) | PERIODIC | (T_IRQ0 + IRQ_TIMER));
+}
+
+// Send interrupt vector vec to the CPU with the given APIC ID.
+void
+lapicsendipi(uchar apicid, int vec)
+{
+  if(!lapic)
+    return;
+  lapicw(ICRHI, apicid<<24);
+  lapicw(ICRLO, FIXED | ASSERT | vec);
+  while(lapic[ICRLO] & DELIVS)
+    ;
+}
+
 int
 lapicid(void)
 {
@@ -17,9 +17,11 @@
 #define SEG_UCODE 3  // user code
 #define SEG_UDATA 4  // user data+stack
 #define SEG_TSS   5  // this process's task state
+#define SEG_UPID  6  // limit is the running process's pid
+#define SEG_UTLS  7  // running thread's local storage, via %gs
 
 // cpu->gdt[NSEGS] holds the above segments.
-#define NSEGS     6
+#define NSEGS     8
 
 #ifndef __ASSEMBLER__
 // Segment Descriptor
@@ -178,12 +180,13 @@ struct gatedesc {
   (gate).off_31_16 = (uint)(off) >> 16;                  \
 }
 
-/**
- * Reference count for pgdir, as multiple threads may share the same pgdir. 
-*/
-struct uvmdesc {
-  int refcount; // -1 if the entry is invalid
-  pde_t* pgdir;
+// Metadata kept by kalloc for every physical page frame.
+struct frame {
+  ushort ref;        // References (PTEs, threads, ...); 0 when free
+  ushort flags;      // FRAME_* below
 };
 
+#define FRAME_FREE      0x0001  // On the allocator's free list
+#define FRAME_PGDIR     0x0002  // A page directory
+
 #endif
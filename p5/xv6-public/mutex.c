@@ -1,4 +1,24 @@
-// Mutex implementation
+// Futexes: the sleeping half of user-space mutexes.
+//
+// macquire and mrelease in ulib take and drop an uncontended
+// mutex with one atomic instruction and never enter the kernel.
+// Only when a thread must wait does it call futex_wait, and only
+// when the lock word says someone is waiting does the releaser
+// enter the kernel to wake them.
+//
+// A futex is named by the physical address of its word, so any
+// two mappings of the same word meet on the same queue. Waiters
+// queue in FIFO order on one of NFUTEX hash chains, and a wake
+// takes exactly the threads it wakes off the front, rather than
+// waking everyone asleep on the word to fight over it again.
+//
+// A mutex waiter uses futex_waitpi, which reads the holder's
+// pid from the lock word and lends it the waiter's priority
+// (see piwait in proc.c). An adaptive mutex first asks it only
+// to spin while the holder runs, before it marks the word as
+// having waiters. Its release, futex_unlockpi, hands
+// the mutex straight to the first waiter, so a thread arriving
+// meanwhile cannot take it from under one that has waited.
 
 #include "types.h"
 #include "defs.h"
@@ -10,33 +30,209 @@
 #include "spinlock.h"
 #include "mutex.h"
 
-/*void
-m_init(mutex* m)
-{
-  initlock(&m->lk, "mutex");
-  m->locked = 0;
-  m->pid = 0; // pid is set to zero until acquired
-}*/
+#define NFUTEX 64
+
+struct futexq {
+  struct proc *head;
+  struct proc *tail;
+};
+
+struct {
+  struct spinlock lock;
+  struct futexq q[NFUTEX];
+} futex;
 
 void
-macquire(mutex *m)
+futexinit(void)
+{
+  initlock(&futex.lock, "futex");
+}
+
+// Kernel address of the user word at uaddr, or 0 if uaddr
+// is not an aligned word in a present user page.
+static volatile uint*
+futexword(uint uaddr)
+{
+  struct proc *curproc = myproc();
+  char *ka;
+
+  if(uaddr % sizeof(uint) != 0 || uaddr >= curproc->vm->sz)
+    return 0;
+  if((ka = uva2ka(curproc->vm->pgdir, (char*)uaddr)) == 0)
+    return 0;
+  return (volatile uint*)(ka + (uaddr & (PGSIZE-1)));
+}
+
+static struct futexq*
+futexq(uint key)
 {
-  acquire(&m->lk);
-  while (m->locked) {
-    sleep(m, &m->lk);
+  return &futex.q[(key / sizeof(uint)) % NFUTEX];
+}
+
+// Remove the first waiter on key that has not been killed
+// and return it, or 0 if there is none. If more is not 0,
+// set *more to the next waiter on key still queued, or 0;
+// with FIFO order that is usually the very next entry.
+// Caller must hold futex.lock.
+static struct proc*
+futexpop(uint key, struct proc **more)
+{
+  struct futexq *q = futexq(key);
+  struct proc *p, *prev = 0, *n;
+
+  for(p = q->head; p; prev = p, p = p->fxnext)
+    if(p->fxkey == key && !p->killed)
+      break;
+  if(p == 0)
+    return 0;
+  if(more){
+    for(n = p->fxnext; n && n->fxkey != key; n = n->fxnext)
+      ;
+    *more = n;
   }
-  m->locked = 1;
-  m->pid = myproc()->pid;
-  release(&m->lk);
+  if(prev)
+    prev->fxnext = p->fxnext;
+  else
+    q->head = p->fxnext;
+  if(q->tail == p)
+    q->tail = prev;
+  p->fxnext = 0;
+  p->fxkey = 0;
+  return p;
 }
 
-void
-mrelease(mutex *m)
+// Take p off its queue. Caller must hold futex.lock.
+static void
+futexremove(struct proc *p)
+{
+  struct futexq *q = futexq(p->fxkey);
+  struct proc *prev = 0;
+
+  if(q->head != p)
+    for(prev = q->head; prev->fxnext != p; prev = prev->fxnext)
+      ;
+  if(prev)
+    prev->fxnext = p->fxnext;
+  else
+    q->head = p->fxnext;
+  if(q->tail == p)
+    q->tail = prev;
+  p->fxnext = 0;
+  p->fxkey = 0;
+}
+
+// Sleep until woken by futex_wake, provided the word at uaddr
+// still holds val. Checking and sleeping under futex.lock
+// means a wake that follows a change to the word cannot be lost.
+// While asleep, lend our priority to process owner, if any.
+// Returns FUTEX_SLEPT if we slept, 0 if the word had changed.
+static int
+futexsleep(uint uaddr, uint val, int owner)
 {
-  acquire(&m->lk);
-  m->locked = 0;
-  m->pid = 0;
-  wakeup(m);
-  release(&m->lk);
+  struct proc *curproc = myproc();
+  struct futexq *q;
+  volatile uint *w;
+  uint key;
+
+  if((w = futexword(uaddr)) == 0)
+    return -1;
+  key = V2P(w);
+  acquire(&futex.lock);
+  if(*w != val || curproc->killed){
+    release(&futex.lock);
+    return 0;
+  }
+  q = futexq(key);
+  curproc->fxkey = key;
+  curproc->fxnext = 0;
+  if(q->tail)
+    q->tail->fxnext = curproc;
+  else
+    q->head = curproc;
+  q->tail = curproc;
+  if(owner)
+    piwait(owner);
+  sleep((void*)key, &futex.lock);
+  if(curproc->fxkey)  // killed, not woken
+    futexremove(curproc);
+  release(&futex.lock);
+  if(owner)
+    piwait(0);
+  return FUTEX_SLEPT;
+}
+
+int
+futex_wait(uint uaddr, uint val)
+{
+  return futexsleep(uaddr, val, 0);
+}
+
+// futex_wait on a mutex lock word, which names its holder.
+// If spin is set, only busy-wait while the word holds val and
+// the holder is running: a short critical section will likely
+// end sooner than a context switch would. Returns FUTEX_SPUN
+// if the word changed, 0 if the holder stopped running first,
+// and never sleeps; the caller then sets MUTEX_WAITERS and
+// calls again without spin to sleep.
+int
+futex_waitpi(uint uaddr, uint val, int spin)
+{
+  volatile uint *w;
+  int owner = val & ~MUTEX_WAITERS;
+
+  if(spin){
+    if((w = futexword(uaddr)) == 0)
+      return -1;
+    return spinowner(owner, w, val) ? FUTEX_SPUN : 0;
+  }
+  return futexsleep(uaddr, val, owner);
 }
 
+// Wake the first n threads waiting on the word at uaddr.
+// Returns the number woken.
+int
+futex_wake(uint uaddr, int n)
+{
+  struct proc *p;
+  volatile uint *w;
+  uint key;
+  int k;
+
+  if((w = futexword(uaddr)) == 0)
+    return -1;
+  key = V2P(w);
+  acquire(&futex.lock);
+  for(k = 0; k < n && (p = futexpop(key, 0)) != 0; k++)
+    wakeproc(p, (void*)key);
+  release(&futex.lock);
+  return k;
+}
+
+// Release the mutex whose lock word is at uaddr, which the
+// caller holds and others wait for. Ownership passes directly
+// to the longest waiter, with MUTEX_WAITERS still set if more
+// remain, along with the priority the others lend.
+int
+futex_unlockpi(uint uaddr)
+{
+  struct proc *p, *more;
+  volatile uint *w;
+  uint key;
+
+  if((w = futexword(uaddr)) == 0)
+    return -1;
+  key = V2P(w);
+  acquire(&futex.lock);
+  if((*w & ~MUTEX_WAITERS) != myproc()->pid){
+    release(&futex.lock);
+    return -1;
+  }
+  if((p = futexpop(key, &more)) == 0)
+    *w = 0;
+  else {
+    *w = p->pid | (more ? MUTEX_WAITERS : 0);
+    pihandoff(p, (void*)key, more);
+  }
+  release(&futex.lock);
+  return 0;
+}
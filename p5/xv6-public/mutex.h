@@ -3,16 +3,23 @@
 #ifndef __MUTEX_H__
 #define __MUTEX_H__
 
-#include "spinlock.h"
+// The lock word holds the holder's pid, or 0 when the mutex is
+// free. MUTEX_WAITERS is set once someone may be asleep in
+// futex_waitpi on it, telling mrelease to enter the kernel.
+#define MUTEX_WAITERS 0x80000000
+
+// What futex_wait and futex_waitpi did, if not an error.
+#define FUTEX_SPUN  1  // saw the word change while spinning
+#define FUTEX_SLEPT 2  // slept until woken
 
 typedef struct {
-  uint locked;       // Is the lock held?
-  struct spinlock lk;
-  // For debugging:
-  int pid;           // Process holding lock
+  volatile uint locked;  // holder's pid | MUTEX_WAITERS
+  int adaptive;          // spin while the holder runs, then sleep
+  // Contention counters, updated by the holder:
+  uint contended;        // acquires that found the mutex held
+  uint spins;            // times those waited by spinning
+  uint sleeps;           // times those slept in the kernel
+  uint handoffs;         // acquires handed over by mrelease
 } mutex;
 
-
-//void m_init(mutex* m);
-
 #endif
@@ -0,0 +1,76 @@
+#include "types.h"
+#include "user.h"
+
+#define N_THREAD 4
+#define N_ITER 10000
+
+mutex m;
+int global_counter = 0;
+
+void fn(void* arg) {
+  for (int i = 0; i < N_ITER; i++) {
+    macquire(&m);
+    global_counter++;
+    mrelease(&m);
+  }
+
+  exit();
+}
+
+// Run N_THREAD clone()d threads contending m and check
+// that no increment was lost and the counters add up.
+int run(int adaptive) {
+  char* stacks[N_THREAD];
+  void* stack;
+  int ok = 1;
+
+  minit(&m);
+  m.adaptive = adaptive;
+  global_counter = 0;
+  for (int i = 0; i < N_THREAD; i++) {
+    stacks[i] = (char*)malloc(4096);
+    if (clone(fn, stacks[i] + 4096, 0) < 0) {
+      printf(2, "clone error\n");
+      return 0;
+    }
+  }
+
+  for (int i = 0; i < N_THREAD; i++) {
+    join(-1, &stack);
+  }
+  for (int i = 0; i < N_THREAD; i++) {
+    free(stacks[i]);
+  }
+
+  printf(1, "%s: counter %d, contended %d, spins %d, sleeps %d, handoffs %d\n",
+         adaptive ? "adaptive" : "sleeping", global_counter,
+         m.contended, m.spins, m.sleeps, m.handoffs);
+
+  if (global_counter != N_THREAD * N_ITER) {
+    printf(1, "lost increments\n");
+    ok = 0;
+  }
+  // Every acquire that waited was counted once as contended,
+  // and the mutex is only handed to a waiter that slept.
+  if (m.contended > N_THREAD * N_ITER || m.handoffs > m.contended ||
+      m.handoffs > m.sleeps) {
+    printf(1, "counters do not add up\n");
+    ok = 0;
+  }
+  if (!adaptive && m.spins != 0) {
+    printf(1, "spun without adaptive set\n");
+    ok = 0;
+  }
+  return ok;
+}
+
+int main() {
+  int ok = run(0);
+
+  if (!run(1)) {
+    ok = 0;
+  }
+  printf(1, ok ? "mutextest ok\n" : "mutextest FAILED\n");
+
+  exit();
+}
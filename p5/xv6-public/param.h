@@ -10,5 +10,8 @@
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
 #define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
 #define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       1000  // size of file system in blocks
+#define FSSIZE       2000  // size of file system in blocks
+#define SCHED_PRIO      0  // scheduler: strict nice priority, FIFO within a level
+#define SCHED_FAIR      1  // scheduler: least weighted run time first
+#define SCHEDMODE SCHED_PRIO  // scheduler mode at boot, see setsched()
 
@@ -4,28 +4,69 @@
 #include "memlayout.h"
 #include "mmu.h"
 #include "x86.h"
+#include "traps.h"
 #include "proc.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 
 Ptable ptable;
 
 static struct proc *initproc;
 
-// Reference count for pgdir
-extern struct uvmdesc uvmrefcount[NPROC];
+// Locks, in the order they are taken:
+//  ptable.lock   process lifecycle: allocating and freeing slots,
+//                parent, and the exit, wait and join handshakes.
+//                Held to look a process up by pid, so that it is
+//                not reaped meanwhile.
+//  pilock        priority inheritance: piowner, basenice, and
+//                every change to nice.
+//  p->lock       p->state and p->chan. Held across the switch
+//                into and out of p. Leaving UNUSED or becoming
+//                ZOMBIE also needs ptable.lock.
+//  rq.lock       a CPU's run queue, and p->rq of those on it.
+// Scheduling, sleep and wakeup take only the last two.
+static struct spinlock pilock;
 
 int nextpid = 1;
+int schedmode = SCHEDMODE;
+
+// Load weight of each nice level, as in Linux: a level gets
+// about 25% more CPU time than the next lower priority one.
+static const int niceweight[NNICE] = {
+ /* -20 */ 88761, 71755, 56483, 46273, 36291,
+ /* -15 */ 29154, 23254, 18705, 14949, 11916,
+ /* -10 */  9548,  7620,  6100,  4904,  3906,
+ /*  -5 */  3121,  2501,  1991,  1586,  1277,
+ /*   0 */  1024,   820,   655,   526,   423,
+ /*   5 */   335,   272,   215,   172,   137,
+ /*  10 */   110,    87,    70,    56,    45,
+ /*  15 */    36,    29,    23,    18,    15,
+};
+
+// vruntime a nice 0 process accrues per tick. A process that
+// has slept comes back at most VRSLACK behind the queue.
+#define VRTICK  1024
+#define VRSLACK (2*VRTICK)
+
+// vruntime wraps; compare by difference.
+#define VRBEFORE(a, b) ((int)((a) - (b)) < 0)
 extern void forkret(void);
 extern void trapret(void);
 
-static void wakeup1(void *chan);
+static void setrunnable(struct proc *p);
 
 void
 pinit(void)
 {
+  struct proc *p;
+  struct cpu *c;
+
   initlock(&ptable.lock, "ptable");
-  for (int i = 0; i < NPROC; i++)
-    uvmrefcount[i].refcount = -1;
+  initlock(&pilock, "pi");
+  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++)
+    initlock(&p->lock, "proc");
+  for(c = cpus; c < &cpus[NCPU]; c++)
+    initlock(&c->rq.lock, "runq");
 }
 
 // Must be called with interrupts disabled
@@ -91,11 +132,19 @@ found:
   p->state = EMBRYO;
   p->pid = nextpid++;
   p->nclone = 0;
-  p->sleepticks = -1;
+  p->timeridx = -1;
   p->chan = 0;
   
   // init nice to 0
   p->nice = 0;
+  p->basenice = 0;
+  p->piowner = 0;
+  p->fxkey = 0;
+  p->ustack = 0;
+  p->tls = 0;
+  p->vruntime = 0;
+  p->lastcpu = -1;
+  p->affinity = ~0;
 
   release(&ptable.lock);
 
@@ -129,15 +178,17 @@ void
 userinit(void)
 {
   struct proc *p;
+  pde_t *pgdir;
   extern char _binary_initcode_start[], _binary_initcode_size[];
 
   p = allocproc();
   
   initproc = p;
-  if((p->pgdir = setupkvm()) == 0)
+  if((pgdir = setupkvm()) == 0)
     panic("userinit: out of memory?");
-  inituvm(p->pgdir, _binary_initcode_start, (int)_binary_initcode_size);
-  p->sz = PGSIZE;
+  inituvm(pgdir, _binary_initcode_start, (int)_binary_initcode_size);
+  if((p->vm = vmcreate(pgdir, PGSIZE)) == 0)
+    panic("userinit: no vmspace");
   memset(p->tf, 0, sizeof(*p->tf));
   p->tf->cs = (SEG_UCODE << 3) | DPL_USER;
   p->tf->ds = (SEG_UDATA << 3) | DPL_USER;
@@ -154,32 +205,38 @@ userinit(void)
   // run this process. the acquire forces the above
   // writes to be visible, and the lock is also needed
   // because the assignment might not be atomic.
-  acquire(&ptable.lock);
+  acquire(&p->lock);
 
-  p->state = RUNNABLE;
+  setrunnable(p);
 
-  release(&ptable.lock);
+  release(&p->lock);
 }
 
-// Grow current process's memory by n bytes.
-// Return 0 on success, -1 on failure.
+// Grow current process's memory by n bytes. Any thread of
+// the process may call this; they all see the new size.
+// Return the old size on success, -1 on failure.
 int
 growproc(int n)
 {
-  uint sz;
-  struct proc *curproc = myproc();
+  uint sz, oldsz;
+  struct vmspace *vm = myproc()->vm;
 
-  sz = curproc->sz;
+  acquiresleep(&vm->lock);
+  sz = oldsz = vm->sz;
   if(n > 0){
-    if((sz = allocuvm(curproc->pgdir, sz, sz + n)) == 0)
+    if((sz = allocuvm(vm->pgdir, sz, sz + n)) == 0){
+      releasesleep(&vm->lock);
       return -1;
+    }
   } else if(n < 0){
-    if((sz = deallocuvm(curproc->pgdir, sz, sz + n)) == 0)
+    if((sz = deallocuvm(vm->pgdir, sz, sz + n)) == 0){
+      releasesleep(&vm->lock);
       return -1;
+    }
   }
-  curproc->sz = sz;
-  switchuvm(curproc);
-  return 0;
+  vm->sz = sz;
+  releasesleep(&vm->lock);
+  return oldsz;
 }
 
 // Create a new process copying p as the parent.
@@ -189,6 +246,8 @@ int
 fork(void)
 {
   int i, pid;
+  uint sz;
+  pde_t *pgdir;
   struct proc *np;
   struct proc *curproc = myproc();
 
@@ -198,13 +257,21 @@ fork(void)
   }
 
   // Copy process state from proc.
-  if((np->pgdir = copyuvm(curproc->pgdir, curproc->sz)) == 0){
+  acquiresleep(&curproc->vm->lock);
+  sz = curproc->vm->sz;
+  pgdir = copyuvm(curproc->vm->pgdir, sz);
+  releasesleep(&curproc->vm->lock);
+  if(pgdir == 0 || (np->vm = vmcreate(pgdir, sz)) == 0){
+    if(pgdir)
+      freevm(pgdir);
     kfree(np->kstack);
     np->kstack = 0;
     np->state = UNUSED;
     return -1;
   }
-  np->sz = curproc->sz;
+  np->vruntime = curproc->vruntime;
+  np->affinity = curproc->affinity;
+  np->tls = curproc->tls;
   np->parent = curproc;
   *np->tf = *curproc->tf;
 
@@ -220,18 +287,15 @@ fork(void)
 
   pid = np->pid;
 
-  acquire(&ptable.lock);
+  acquire(&np->lock);
 
-  np->state = RUNNABLE;
+  setrunnable(np);
 
-  release(&ptable.lock);
+  release(&np->lock);
 
   return pid;
 }
 
-extern struct uvmdesc *locate_uvmrefcount(pde_t* pgdir);
-extern struct uvmdesc *allocate_uvmrefcount(pde_t* pgdir, int refcount);
-
 int
 clone(void (*fn)(void*), void* stack, void* arg)
 {
@@ -244,20 +308,18 @@ clone(void (*fn)(void*), void* stack, void* arg)
     return -1;
   }
 
-  np->pgdir = curproc->pgdir;
-  struct uvmdesc *uvmd;
-  if ((uvmd = locate_uvmrefcount(curproc->pgdir)) != 0) {
-    uvmd->refcount += 1;
-  } else {
-    uvmd = allocate_uvmrefcount(curproc->pgdir, 2);
-  }
+  np->vm = vmdup(curproc->vm);
+  np->ustack = stack;
+  np->tls = 0;
   np->chan = 0;
-  np->sz = curproc->sz;
+  np->vruntime = curproc->vruntime;
+  np->affinity = curproc->affinity;
   np->parent = curproc;
   *np->tf = *curproc->tf;
 
   // Clear %eax so that fork returns 0 in the child.
   np->tf->eax = 0;
+  np->tf->gs = 0;  // no thread-local storage until settls
 
   uint *ustack = (uint *)stack;
   ustack[-1] = (uint)arg;
@@ -286,11 +348,11 @@ clone(void (*fn)(void*), void* stack, void* arg)
 
   pid = np->pid;
 
-  acquire(&ptable.lock);
+  acquire(&np->lock);
 
-  np->state = RUNNABLE;
+  setrunnable(np);
 
-  release(&ptable.lock);
+  release(&np->lock);
 
   return pid;
 }
@@ -323,24 +385,59 @@ exit(void)
 
   acquire(&ptable.lock);
 
-  // Parent might be sleeping in wait().
-  wakeup1(curproc->parent);
+  // Parent might be sleeping in wait(), and
+  // other threads in join().
+  wakeup(curproc->parent);
+  wakeup(curproc->vm);
 
   // Pass abandoned children to init.
   for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
     if(p->parent == curproc){
       p->parent = initproc;
       if(p->state == ZOMBIE)
-        wakeup1(initproc);
+        wakeup(initproc);
     }
   }
 
-  // Jump into the scheduler, never to return.
+  // Stop donating priority to this process.
+  acquire(&pilock);
+  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++)
+    if(p->piowner == curproc)
+      p->piowner = 0;
+  release(&pilock);
+
+  // Jump into the scheduler, never to return. The
+  // scheduler releases curproc->lock once it is off
+  // our stack; reap() waits for that.
+  acquire(&curproc->lock);
   curproc->state = ZOMBIE;
+  release(&ptable.lock);
   sched();
   panic("zombie exit");
 }
 
+// Free the ZOMBIE p and return its pid.
+// Caller must hold ptable.lock.
+static int
+reap(struct proc *p)
+{
+  int pid = p->pid;
+
+  // p may still be switching out on another CPU.
+  acquire(&p->lock);
+  release(&p->lock);
+  kfree(p->kstack);
+  p->kstack = 0;
+  vmput(p->vm);
+  p->vm = 0;
+  p->pid = 0;
+  p->parent = 0;
+  p->name[0] = 0;
+  p->killed = 0;
+  p->state = UNUSED;
+  return pid;
+}
+
 // Wait for a child process to exit and return its pid.
 // Return -1 if this process has no children.
 int
@@ -360,15 +457,7 @@ wait(void)
       havekids = 1;
       if(p->state == ZOMBIE){
         // Found one.
-        pid = p->pid;
-        kfree(p->kstack);
-        p->kstack = 0;
-        freevm(p->pgdir);
-        p->pid = 0;
-        p->parent = 0;
-        p->name[0] = 0;
-        p->killed = 0;
-        p->state = UNUSED;
+        pid = reap(p);
         release(&ptable.lock);
         return pid;
       }
@@ -380,11 +469,466 @@ wait(void)
       return -1;
     }
 
-    // Wait for children to exit.  (See wakeup1 call in proc_exit.)
+    // Wait for children to exit.  (See wakeup call in proc_exit.)
     sleep(curproc, &ptable.lock);  //DOC: wait-sleep
   }
 }
 
+// Wait for thread tid, or any thread if tid is -1, of this
+// process to exit. Returns its pid and stores the stack it was
+// clone()d with in *stack, for the caller to reuse or free.
+// Return -1 if there is no such thread.
+int
+join(int tid, void **stack)
+{
+  struct proc *p;
+  int found, pid;
+  void *ustack;
+  struct proc *curproc = myproc();
+
+  acquire(&ptable.lock);
+  for(;;){
+    found = 0;
+    for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+      if(p == curproc || p->vm != curproc->vm || p->ustack == 0)
+        continue;
+      if(tid != -1 && p->pid != tid)
+        continue;
+      found = 1;
+      if(p->state == ZOMBIE){
+        ustack = p->ustack;
+        pid = reap(p);
+        release(&ptable.lock);
+        *stack = ustack;
+        return pid;
+      }
+    }
+
+    if(!found || curproc->killed){
+      release(&ptable.lock);
+      return -1;
+    }
+
+    // Threads wake us as they exit.
+    sleep(curproc->vm, &ptable.lock);
+  }
+}
+
+static void
+heapswap(struct runq *rq, int i, int j)
+{
+  struct proc *p = rq->heap[i];
+
+  rq->heap[i] = rq->heap[j];
+  rq->heap[j] = p;
+}
+
+static void
+heapup(struct runq *rq, int i)
+{
+  for(; i > 0 && VRBEFORE(rq->heap[i]->vruntime,
+                          rq->heap[(i-1)/2]->vruntime); i = (i-1)/2)
+    heapswap(rq, i, (i-1)/2);
+}
+
+static void
+heapdown(struct runq *rq, int i)
+{
+  int c;
+
+  for(; (c = 2*i + 1) < rq->n; i = c){
+    if(c + 1 < rq->n &&
+       VRBEFORE(rq->heap[c+1]->vruntime, rq->heap[c]->vruntime))
+      c++;
+    if(!VRBEFORE(rq->heap[c]->vruntime, rq->heap[i]->vruntime))
+      break;
+    heapswap(rq, i, c);
+  }
+}
+
+// Queue p on rq: behind the others at its nice level, or
+// by vruntime under SCHED_FAIR. Caller must hold rq->lock.
+static void
+rqpush(struct runq *rq, struct proc *p)
+{
+  int q = p->nice + 20;
+
+  p->rq = rq;
+  if(schedmode == SCHED_FAIR){
+    if(VRBEFORE(p->vruntime, rq->minvrun - VRSLACK))
+      p->vruntime = rq->minvrun - VRSLACK;
+    rq->heap[rq->n++] = p;
+    heapup(rq, rq->n - 1);
+    return;
+  }
+  p->rqnext = 0;
+  if(rq->tail[q])
+    rq->tail[q]->rqnext = p;
+  else
+    rq->head[q] = p;
+  rq->tail[q] = p;
+  rq->bits[q / 32] |= 1 << (q % 32);
+  rq->n++;
+}
+
+// Dequeue the first process of the best nonempty nice level
+// of rq, or the one with least vruntime under SCHED_FAIR.
+// Returns 0 if rq is empty. Caller must hold rq->lock.
+static struct proc*
+rqpop(struct runq *rq)
+{
+  struct proc *p;
+  int i, q;
+
+  if(schedmode == SCHED_FAIR){
+    if(rq->n == 0)
+      return 0;
+    p = rq->heap[0];
+    rq->heap[0] = rq->heap[--rq->n];
+    heapdown(rq, 0);
+    if(VRBEFORE(rq->minvrun, p->vruntime))
+      rq->minvrun = p->vruntime;
+    p->rq = 0;
+    return p;
+  }
+
+  for(i = 0; i < NELEM(rq->bits); i++)
+    if(rq->bits[i])
+      break;
+  if(i == NELEM(rq->bits))
+    return 0;
+  q = i * 32 + bsf(rq->bits[i]);
+
+  p = rq->head[q];
+  rq->head[q] = p->rqnext;
+  if(rq->head[q] == 0){
+    rq->tail[q] = 0;
+    rq->bits[i] &= ~(1 << (q % 32));
+  }
+  rq->n--;
+  p->rq = 0;
+  p->rqnext = 0;
+  return p;
+}
+
+// Take p off rq, wherever it is queued.
+// Caller must hold rq->lock.
+static void
+rqremove(struct runq *rq, struct proc *p)
+{
+  struct proc *prev;
+  int i, q;
+
+  if(schedmode == SCHED_FAIR){
+    for(i = 0; rq->heap[i] != p; i++)
+      ;
+    rq->heap[i] = rq->heap[--rq->n];
+    if(i < rq->n){
+      heapdown(rq, i);
+      heapup(rq, i);
+    }
+    p->rq = 0;
+    return;
+  }
+
+  q = p->nice + 20;
+  prev = 0;
+  if(rq->head[q] != p)
+    for(prev = rq->head[q]; prev->rqnext != p; prev = prev->rqnext)
+      ;
+  if(prev)
+    prev->rqnext = p->rqnext;
+  else
+    rq->head[q] = p->rqnext;
+  if(rq->tail[q] == p)
+    rq->tail[q] = prev;
+  if(rq->head[q] == 0)
+    rq->bits[q / 32] &= ~(1 << (q % 32));
+  rq->n--;
+  p->rq = 0;
+  p->rqnext = 0;
+}
+
+// The process rqpop would choose among those in rq allowed to
+// run on c, or 0 if there is none. Caller must hold rq->lock.
+static struct proc*
+rqbest(struct runq *rq, struct cpu *c)
+{
+  struct proc *p, *best = 0;
+  uint bit = 1 << (c - cpus);
+  int i, q;
+
+  if(schedmode == SCHED_FAIR){
+    for(i = 0; i < rq->n; i++){
+      p = rq->heap[i];
+      if((p->affinity & bit) &&
+         (best == 0 || VRBEFORE(p->vruntime, best->vruntime)))
+        best = p;
+    }
+    return best;
+  }
+
+  for(q = 0; q < NNICE; q++)
+    for(p = rq->head[q]; p; p = p->rqnext)
+      if(p->affinity & bit)
+        return p;
+  return 0;
+}
+
+// A process in rq running on page table pgdir that is as good
+// a choice as what rqpop would return: one at the same nice
+// level, or within a tick's vruntime under SCHED_FAIR. Running
+// it next saves reloading %cr3. Caller must hold rq->lock.
+static struct proc*
+rqsame(struct runq *rq, pde_t *pgdir)
+{
+  struct proc *p;
+  int i, q;
+
+  if(pgdir == 0 || rq->n == 0)
+    return 0;
+
+  if(schedmode == SCHED_FAIR){
+    for(i = 0; i < 3 && i < rq->n; i++){
+      p = rq->heap[i];
+      if(p->vm->pgdir == pgdir &&
+         VRBEFORE(p->vruntime, rq->heap[0]->vruntime + VRTICK))
+        return p;
+    }
+    return 0;
+  }
+
+  for(i = 0; i < NELEM(rq->bits); i++)
+    if(rq->bits[i])
+      break;
+  q = i * 32 + bsf(rq->bits[i]);
+  for(p = rq->head[q]; p; p = p->rqnext)
+    if(p->vm->pgdir == pgdir)
+      return p;
+  return 0;
+}
+
+// The CPU whose run queue p should wait on: the one that ran
+// it last, whose caches may still hold its working set, if p
+// may still run there; else this CPU or the first allowed one.
+static struct cpu*
+rqcpu(struct proc *p)
+{
+  struct cpu *c;
+
+  if(p->lastcpu >= 0 && (p->affinity & (1 << p->lastcpu)))
+    return &cpus[p->lastcpu];
+  c = mycpu();
+  if(p->affinity & (1 << (c - cpus)))
+    return c;
+  for(c = cpus; c < &cpus[ncpu]; c++)
+    if(p->affinity & (1 << (c - cpus)))
+      return c;
+  panic("rqcpu");
+}
+
+// Make p RUNNABLE on the run queue of rqcpu(p), waking that
+// CPU if it is idle, or else an idle one that could steal p.
+// Caller must hold p->lock.
+static void
+setrunnable(struct proc *p)
+{
+  struct cpu *c = rqcpu(p), *v;
+
+  p->state = RUNNABLE;
+  acquire(&c->rq.lock);
+  rqpush(&c->rq, p);
+  release(&c->rq.lock);
+
+  // The release above orders the push before reading idle;
+  // idle() orders setting idle before its last look at the
+  // queues, so one side or the other sees the work.
+  if(c->idle){
+    lapicsendipi(c->apicid, T_IRQ0 + IRQ_RESCHED);
+    return;
+  }
+  for(v = cpus; v < &cpus[ncpu]; v++){
+    if(v->idle && (p->affinity & (1 << (v - cpus)))){
+      lapicsendipi(v->apicid, T_IRQ0 + IRQ_RESCHED);
+      return;
+    }
+  }
+}
+
+// The other CPU with the longest run queue, or 0 if all
+// of theirs are empty. Looks without taking any lock.
+static struct cpu*
+rqbusiest(struct cpu *c)
+{
+  struct cpu *v, *best = 0;
+
+  for(v = cpus; v < &cpus[ncpu]; v++)
+    if(v != c && v->rq.n > 0 && (best == 0 || v->rq.n > best->rq.n))
+      best = v;
+  return best;
+}
+
+// Take the best process allowed on c from v's run queue.
+static struct proc*
+rqsteal(struct cpu *c, struct cpu *v)
+{
+  struct proc *p;
+
+  acquire(&v->rq.lock);
+  if((p = rqbest(&v->rq, c)) != 0){
+    rqremove(&v->rq, p);
+    // Keep its place relative to the queue it joins.
+    if(schedmode == SCHED_FAIR)
+      p->vruntime += c->rq.minvrun - v->rq.minvrun;
+  }
+  release(&v->rq.lock);
+  return p;
+}
+
+// Dequeue the next process for c to run: the best of its own
+// queue, preferring one on c's loaded page table, else the
+// best one c may run from the busiest other CPU's, else from
+// any other CPU's. Holds one queue's lock at a time.
+static struct proc*
+rqtake(struct cpu *c)
+{
+  struct proc *p;
+  struct cpu *v, *busiest;
+
+  acquire(&c->rq.lock);
+  if((p = rqsame(&c->rq, c->pgdir)) != 0)
+    rqremove(&c->rq, p);
+  else
+    p = rqpop(&c->rq);
+  release(&c->rq.lock);
+  if(p != 0 || (busiest = rqbusiest(c)) == 0)
+    return p;
+  if((p = rqsteal(c, busiest)) != 0)
+    return p;
+  for(v = cpus; v < &cpus[ncpu]; v++)
+    if(v != c && v != busiest && v->rq.n > 0 && (p = rqsteal(c, v)) != 0)
+      return p;
+  return 0;
+}
+
+// Take p off the run queue it waits on and return that
+// queue, or return 0 if it is on none. Caller must hold
+// p->lock, so that no one else can queue p meanwhile.
+static struct runq*
+rqdequeue(struct proc *p)
+{
+  struct runq *rq;
+
+  for(;;){
+    if((rq = p->rq) == 0)
+      return 0;
+    acquire(&rq->lock);
+    if(p->rq == rq){
+      rqremove(rq, p);
+      release(&rq->lock);
+      return rq;
+    }
+    // Some CPU took p before we got the lock.
+    release(&rq->lock);
+  }
+}
+
+// Let process pid run only on the CPUs in mask, bit i standing
+// for cpus[i]. A queued process is requeued on an allowed CPU
+// now, a running one when it next gives up the CPU.
+int
+setaffinity(int pid, uint mask)
+{
+  struct proc *p;
+
+  mask &= (1 << ncpu) - 1;
+  if(mask == 0)
+    return -1;
+
+  acquire(&ptable.lock);
+  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+    if(p->pid != pid || p->state == UNUSED)
+      continue;
+    acquire(&p->lock);
+    if(rqdequeue(p) != 0){
+      p->affinity = mask;
+      setrunnable(p);
+    } else
+      p->affinity = mask;
+    release(&p->lock);
+    release(&ptable.lock);
+    return 0;
+  }
+  release(&ptable.lock);
+  return -1;
+}
+
+// Charge the current process for one timer tick.
+void
+schedtick(void)
+{
+  struct proc *p = myproc();
+
+  p->vruntime += VRTICK * niceweight[20] / niceweight[p->nice + 20];
+}
+
+// Switch every run queue to scheduler mode mode.
+// Returns the previous mode, or -1 if mode is unknown.
+int
+setsched(int mode)
+{
+  struct proc *procs[NPROC], *p;
+  struct cpu *c;
+  int i, n, old;
+
+  if(mode != SCHED_PRIO && mode != SCHED_FAIR)
+    return -1;
+
+  // Hold every queue's lock, taken in CPU order, so no CPU
+  // can see a queue in the wrong mode. A drained process
+  // keeps p->rq, so rqdequeue waits for it to be back.
+  for(c = cpus; c < &cpus[ncpu]; c++)
+    acquire(&c->rq.lock);
+  n = 0;
+  for(c = cpus; c < &cpus[ncpu]; c++){
+    while((p = rqpop(&c->rq)) != 0){
+      p->rq = &c->rq;
+      procs[n++] = p;
+    }
+  }
+  old = schedmode;
+  schedmode = mode;
+  for(i = 0; i < n; i++)
+    rqpush(procs[i]->rq, procs[i]);
+  for(c = cpus; c < &cpus[ncpu]; c++)
+    release(&c->rq.lock);
+  return old;
+}
+
+// Halt c until an interrupt arrives, unless work showed up.
+// All but the first CPU, which keeps ticks, also stop their
+// timer, so an idle CPU costs nothing until setrunnable sends
+// it an IPI. They need no one-shot timer for the next
+// sleepuntil deadline: deadlines are in ticks, which only the
+// first CPU's timer advances, and timerexpire wakes sleepers
+// on the very tick their deadline comes, IPI included.
+static void
+idle(struct cpu *c)
+{
+  cli();
+  xchg(&c->idle, 1);
+  if(c->rq.n == 0 && rqbusiest(c) == 0){
+    if(c != &cpus[0])
+      lapictimer(0);
+    // An interrupt pending since cli() ends the hlt at once.
+    asm volatile("sti; hlt");
+    if(c != &cpus[0])
+      lapictimer(1);
+  }
+  xchg(&c->idle, 0);
+  sti();
+}
+
 //PAGEBREAK: 42
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
@@ -404,49 +948,39 @@ scheduler(void)
     // Enable interrupts on this processor.
     sti();
 
-    // Loop over process table looking for process to run.
-    acquire(&ptable.lock);
-
-    // proc with the highest prio
-    struct proc *nice_p = 0;
-    int highest_prio = 19;
-
-    for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
-      if(p->state != RUNNABLE) 
-        continue;
-      
-      // compare and get higher prio
-      if(p->nice <= highest_prio) {
-        nice_p = p;
-        highest_prio = p->nice;
-      }
-    
+    // Idle without taking any lock until some run
+    // queue, ours or another CPU's, has work.
+    if(c->rq.n == 0 && rqbusiest(c) == 0){
+      if(c->pgdir)
+        idleuvm();
+      idle(c);
+      continue;
     }
 
-    // switch if needed
-    if(nice_p != 0) {
-      p = nice_p;
-
-    // Switch to chosen process.  It is the process's job
-    // to release ptable.lock and then reacquire it
-    // before jumping back to us.
-    //if(p != 0) {
+    // Take the longest-waiting process at the best nice level,
+    // preferring one that shares the page table still loaded.
+    if((p = rqtake(c)) != 0){
+      // Switch to chosen process.  It is the process's job
+      // to release p->lock and then reacquire it before
+      // jumping back to us. A p that just queued itself
+      // from another CPU holds it until it is switched out.
+      acquire(&p->lock);
       c->proc = p;
       switchuvm(p);
       p->state = RUNNING;
+      p->lastcpu = c - cpus;
 
       swtch(&(c->scheduler), p->context);
-      switchkvm();
 
       // Process is done running for now.
       // It should have changed its p->state before coming back.
       c->proc = 0;
+      release(&p->lock);
     }
-    release(&ptable.lock);
   }
 }
 
-// Enter scheduler.  Must hold only ptable.lock
+// Enter scheduler.  Must hold only p->lock
 // and have changed proc->state. Saves and restores
 // intena because intena is a property of this
 // kernel thread, not this CPU. It should
@@ -459,8 +993,8 @@ sched(void)
   int intena;
   struct proc *p = myproc();
 
-  if(!holding(&ptable.lock))
-    panic("sched ptable.lock");
+  if(!holding(&p->lock))
+    panic("sched p->lock");
   if(mycpu()->ncli != 1)
     panic("sched locks");
   if(p->state == RUNNING)
@@ -476,10 +1010,12 @@ sched(void)
 void
 yield(void)
 {
-  acquire(&ptable.lock);  //DOC: yieldlock
-  myproc()->state = RUNNABLE;
+  struct proc *p = myproc();
+
+  acquire(&p->lock);  //DOC: yieldlock
+  setrunnable(p);
   sched();
-  release(&ptable.lock);
+  release(&p->lock);
 }
 
 // A fork child's very first scheduling by scheduler()
@@ -488,8 +1024,8 @@ void
 forkret(void)
 {
   static int first = 1;
-  // Still holding ptable.lock from scheduler.
-  release(&ptable.lock);
+  // Still holding p->lock from scheduler.
+  release(&myproc()->lock);
 
   if (first) {
     // Some initialization functions must be run in the context
@@ -516,16 +1052,15 @@ sleep(void *chan, struct spinlock *lk)
   if(lk == 0)
     panic("sleep without lk");
 
-  // Must acquire ptable.lock in order to
+  // Must acquire p->lock in order to
   // change p->state and then call sched.
-  // Once we hold ptable.lock, we can be
+  // Once we hold p->lock, we can be
   // guaranteed that we won't miss any wakeup
-  // (wakeup runs with ptable.lock locked),
+  // (wakeup locks p->lock),
   // so it's okay to release lk.
-  if(lk != &ptable.lock){  //DOC: sleeplock0
-    acquire(&ptable.lock);  //DOC: sleeplock1
-    release(lk);
-  }
+  acquire(&p->lock);  //DOC: sleeplock1
+  release(lk);
+
   // Go to sleep.
   p->chan = chan;
   p->state = SLEEPING;
@@ -536,42 +1071,273 @@ sleep(void *chan, struct spinlock *lk)
   p->chan = 0;
 
   // Reacquire original lock.
-  if(lk != &ptable.lock){  //DOC: sleeplock2
-    release(&ptable.lock);
-    acquire(lk);
-  }
+  release(&p->lock);
+  acquire(lk);
 }
 
-static void 
-wakeup1(void *chan) {
+// Wake up all processes sleeping on chan.
+// Must be called without any p->lock.
+void
+wakeup(void *chan)
+{
   struct proc *p;
 
-  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++)
+  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+    acquire(&p->lock);
     if(p->state == SLEEPING && p->chan == chan)
-      p->state = RUNNABLE;
+      setrunnable(p);
+    release(&p->lock);
+  }
 }
 
-// Wake up all processes sleeping on chan.
+// Priority inheritance. A process waiting in futex_waitpi
+// lends its nice to the mutex holder, p->piowner, whose
+// effective nice is the best of its own and its waiters'.
+// A holder that itself waits passes that on down the chain.
+
+// Effective nice of p. Caller must hold pilock.
+static int
+pinice(struct proc *p)
+{
+  struct proc *q;
+  int n = p->basenice;
+
+  for(q = ptable.proc; q < &ptable.proc[NPROC]; q++)
+    if(q->piowner == p && q->nice < n)
+      n = q->nice;
+  return n;
+}
+
+// Bring the effective nice of p, and of the holders it
+// waits behind, up to date. Stops after NPROC steps in case
+// Set p's nice to n, requeueing it at the new level if it
+// waits on a run queue. Caller must hold pilock.
+static void
+setpnice(struct proc *p, int n)
+{
+  struct runq *rq;
+
+  acquire(&p->lock);
+  if((rq = rqdequeue(p)) != 0){
+    p->nice = n;
+    acquire(&rq->lock);
+    rqpush(rq, p);
+    release(&rq->lock);
+  } else
+    p->nice = n;
+  release(&p->lock);
+}
+
+// Bring the effective nice of p, and of the holders it
+// waits behind, up to date. Stops after NPROC steps in case
+// the waits form a cycle. Caller must hold pilock.
+static void
+pifix(struct proc *p)
+{
+  int i, n;
+
+  for(i = 0; p && i < NPROC; i++, p = p->piowner){
+    if((n = pinice(p)) == p->nice)
+      break;
+    setpnice(p, n);
+  }
+}
+
+// Record that the current process waits for a mutex held by
+// pid, or by no one if pid is 0, and update the priorities
+// of the old and new holders.
 void
-wakeup(void *chan)
+piwait(int pid)
 {
+  struct proc *curproc = myproc();
+  struct proc *p, *old;
+
+  // ptable.lock keeps pid from exiting, and so from
+  // leaving a stale piowner behind, until we are done.
   acquire(&ptable.lock);
-  wakeup1(chan);
+  acquire(&pilock);
+  old = curproc->piowner;
+  curproc->piowner = 0;
+  for(p = ptable.proc; pid && p < &ptable.proc[NPROC]; p++)
+    if(p->pid == pid && p != curproc && p->state != ZOMBIE){
+      curproc->piowner = p;
+      break;
+    }
+  pifix(old);
+  pifix(curproc->piowner);
+  release(&pilock);
   release(&ptable.lock);
 }
 
-void
-sleep_proc_notify() {
-  struct proc *p;
+// Spin while the word at w holds val and process pid, which
+// will change it, is running on another CPU. Returns 1 if the
+// word changed, 0 if pid stopped running first. Reads p
+// without ptable.lock: a stale answer only costs a retry.
+int
+spinowner(int pid, volatile uint *w, uint val)
+{
+  struct proc *curproc = myproc();
+  volatile struct proc *p;
+
   acquire(&ptable.lock);
-  for (p = ptable.proc; p < &ptable.proc[NPROC]; p++)
-    if (p->state == SLEEPING && p->chan == &ticks) {
-      if (p->sleepticks == 0)
-        p->state = RUNNABLE;
-      else
-        p->sleepticks -= 1;
-    }
+  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++)
+    if(p->pid == pid)
+      break;
   release(&ptable.lock);
+  if(p == &ptable.proc[NPROC] || p == curproc)
+    return 0;
+
+  while(*w == val){
+    if(p->pid != pid || p->state != RUNNING || curproc->killed)
+      return 0;
+    pause();
+  }
+  return 1;
+}
+
+// Set the current process's own nice.
+void
+setnice(int n)
+{
+  struct proc *curproc = myproc();
+
+  acquire(&pilock);
+  curproc->basenice = n;
+  setpnice(curproc, pinice(curproc));
+  pifix(curproc->piowner);
+  release(&pilock);
+}
+
+// The current process is handing the mutex whose waiters
+// sleep on chan to p. Wake p, and have those still waiting,
+// found along their futex queue from more on, lend their
+// priority to it instead. p keeps the waiters it had and
+// gains these, so its nice can only improve, to the best of
+// theirs; only the current process, if it was boosted, needs
+// its nice worked out again.
+void
+pihandoff(struct proc *p, void *chan, struct proc *more)
+{
+  struct proc *curproc = myproc();
+  struct proc *q;
+  int n, waiting;
+
+  acquire(&pilock);
+  n = p->nice;
+  for(q = more; q; q = q->fxnext){
+    acquire(&q->lock);
+    waiting = q->chan == chan;
+    release(&q->lock);
+    if(q->piowner == curproc && waiting){
+      q->piowner = p;
+      if(q->nice < n)
+        n = q->nice;
+    }
+  }
+  p->piowner = 0;
+  if(n != p->nice)
+    setpnice(p, n);
+  wakeproc(p, chan);
+  if(curproc->nice != curproc->basenice)
+    pifix(curproc);
+  release(&pilock);
+}
+
+// Wake p if it is sleeping on chan, without
+// looking at anyone else who is.
+void
+wakeproc(struct proc *p, void *chan)
+{
+  acquire(&p->lock);
+  if(p->state == SLEEPING && p->chan == chan)
+    setrunnable(p);
+  release(&p->lock);
+}
+
+// Processes in sleepuntil, in a min-heap on wakeat guarded by
+// tickslock. The timer interrupt only looks at the top, so a
+// tick costs nothing more unless some sleep has run out.
+static struct {
+  struct proc *heap[NPROC];
+  int n;
+} timers;
+
+#define TBEFORE(p, q) ((int)((p)->wakeat - (q)->wakeat) < 0)
+
+static void
+timerset(int i, struct proc *p)
+{
+  timers.heap[i] = p;
+  p->timeridx = i;
+}
+
+// Move the entry at i up or down to where it belongs.
+static void
+timerfix(int i)
+{
+  struct proc *p = timers.heap[i];
+  int c;
+
+  for(; i > 0 && TBEFORE(p, timers.heap[(i-1)/2]); i = (i-1)/2)
+    timerset(i, timers.heap[(i-1)/2]);
+  for(; (c = 2*i + 1) < timers.n; i = c){
+    if(c + 1 < timers.n && TBEFORE(timers.heap[c+1], timers.heap[c]))
+      c++;
+    if(!TBEFORE(timers.heap[c], p))
+      break;
+    timerset(i, timers.heap[c]);
+  }
+  timerset(i, p);
+}
+
+static void
+timerdel(struct proc *p)
+{
+  int i = p->timeridx;
+
+  if(i < 0)
+    return;
+  p->timeridx = -1;
+  if(i < --timers.n){
+    timerset(i, timers.heap[timers.n]);
+    timerfix(i);
+  }
+}
+
+// Sleep until ticks reaches deadline. Returns -1 if the
+// process is killed first. Caller must hold tickslock.
+int
+sleepuntil(uint deadline)
+{
+  struct proc *p = myproc();
+
+  while((int)(ticks - deadline) < 0){
+    if(p->killed)
+      return -1;
+    p->wakeat = deadline;
+    timerset(timers.n++, p);
+    timerfix(p->timeridx);
+    sleep(&p->wakeat, &tickslock);
+    timerdel(p);  // in case kill woke us early
+  }
+  return 0;
+}
+
+// Wake the processes whose sleepuntil deadline has come.
+// Called on each tick with tickslock held.
+void
+timerexpire(void)
+{
+  struct proc *p;
+
+  while(timers.n > 0 && (int)(timers.heap[0]->wakeat - ticks) <= 0){
+    p = timers.heap[0];
+    timerdel(p);
+    acquire(&p->lock);
+    if(p->state == SLEEPING && p->chan == &p->wakeat)
+      setrunnable(p);
+    release(&p->lock);
+  }
 }
 
 // Kill the process with the given pid.
@@ -587,8 +1353,10 @@ kill(int pid)
     if(p->pid == pid){
       p->killed = 1;
       // Wake process from sleep if necessary.
+      acquire(&p->lock);
       if(p->state == SLEEPING)
-        p->state = RUNNABLE;
+        setrunnable(p);
+      release(&p->lock);
       release(&ptable.lock);
       return 0;
     }
@@ -3,6 +3,32 @@
 
 #define MAXPROCNAMELEN 16
 #include "spinlock.h"
+#include "sleeplock.h"
+
+#define NNICE 40               // nice levels, -20 through 19
+
+// A CPU's run queue of RUNNABLE processes. Under SCHED_PRIO,
+// a FIFO per nice level, bit i of bits set iff queue i is
+// nonempty. Under SCHED_FAIR, a min-heap on vruntime.
+// Changed only under lock; n is also read without it.
+struct runq {
+  struct spinlock lock;
+  struct proc *head[NNICE];
+  struct proc *tail[NNICE];
+  uint bits[(NNICE + 31) / 32];
+  struct proc *heap[NPROC];
+  uint minvrun;                // never decreases; floor for wakers
+  volatile int n;              // processes queued, read without lock
+};
+
+// A user address space, shared by all the threads clone()d
+// from one process. exec gives the caller a fresh one.
+struct vmspace {
+  struct sleeplock lock;       // Held while the size changes
+  int ref;                     // Threads using it; 0 if unused
+  pde_t *pgdir;                // Page table
+  uint sz;                     // Size of process memory (bytes)
+};
 
 // Per-CPU state
 struct cpu {
@@ -14,6 +40,12 @@ struct cpu {
   int ncli;                    // Depth of pushcli nesting.
   int intena;                  // Were interrupts enabled before pushcli?
   struct proc *proc;           // The process running on this cpu or null
+  struct runq rq;              // Processes waiting to run here
+  pde_t *pgdir;                // User page table in %cr3, held; or 0
+  uint cr3loads;               // Times %cr3 was loaded with a user pgdir
+  uint cr3skips;               // Loads avoided, the pgdir being in %cr3
+  volatile uint idle;          // Halted in idle(), to be woken by IPI
+  volatile uint tlbflushes;    // TLB flushes asked of it by tlbshootdown
 };
 
 extern struct cpu cpus[NCPU];
@@ -42,9 +74,11 @@ enum procstate { UNUSED, EMBRYO, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
 // Per-process state
 struct proc {
-  uint sz;                     // Size of process memory (bytes)
-  pde_t* pgdir;                // Page table
+  struct vmspace *vm;          // Address space
+  void *ustack;                // Stack given to clone, for join
+  uint tls;                    // Base of %gs when set up by settls
   char *kstack;                // Bottom of kernel stack for this process
+  struct spinlock lock;        // Guards state and chan; held across swtch
   enum procstate state;        // Process state
   int pid;                     // Process ID
   struct proc *parent;         // Parent process
@@ -56,10 +90,21 @@ struct proc {
   struct inode *cwd;           // Current directory
   char name[MAXPROCNAMELEN];               // Process name (debugging)
   int nclone;                  // Number of clone calls on this proc (for grading)
-  int sleepticks;              // Number of ticks left the process should sleep for
+  uint wakeat;                 // Tick a timed sleep ends at
+  int timeridx;                // Index in the timer heap, or -1
 
-  int nice;                    // nice
+  int nice;                    // nice, raised by piowner's waiters
+  int basenice;                // nice as last set by nice()
+  struct proc *piowner;        // Holder of the mutex p waits on, or 0
+  uint fxkey;                  // Futex p is queued on, or 0
+  struct proc *fxnext;         // Next on that futex's hash chain
+  uint vruntime;               // Ticks run, scaled by 1024/weight of nice
+  int lastcpu;                 // CPU that last ran p, -1 if none yet
+  uint affinity;               // Bit i set if p may run on cpus[i]
+  struct runq *rq;             // Run queue holding p, under its lock
+  struct proc *rqnext;         // Next on that queue at p's nice
 };
+
 typedef struct {
   struct spinlock lock;
   struct proc proc[NPROC];
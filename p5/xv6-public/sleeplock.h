@@ -1,3 +1,6 @@
+#ifndef __SLEEPLOCK__
+#define __SLEEPLOCK__
+
 // Long-term locks for processes
 struct sleeplock {
   uint locked;       // Is the lock held?
@@ -8,3 +11,4 @@ struct sleeplock {
   int pid;           // Process holding lock
 };
 
+#endif
@@ -19,7 +19,7 @@ fetchint(uint addr, int *ip)
 {
   struct proc *curproc = myproc();
 
-  if(addr >= curproc->sz || addr+4 > curproc->sz)
+  if(addr >= curproc->vm->sz || addr+4 > curproc->vm->sz)
     return -1;
   *ip = *(int*)(addr);
   return 0;
@@ -34,10 +34,10 @@ fetchstr(uint addr, char **pp)
   char *s, *ep;
   struct proc *curproc = myproc();
 
-  if(addr >= curproc->sz)
+  if(addr >= curproc->vm->sz)
     return -1;
   *pp = (char*)addr;
-  ep = (char*)curproc->sz;
+  ep = (char*)curproc->vm->sz;
   for(s = *pp; s < ep; s++){
     if(*s == 0)
       return s - *pp;
@@ -63,7 +63,7 @@ argptr(int n, char **pp, int size)
  
   if(argint(n, &i) < 0)
     return -1;
-  if(size < 0 || (uint)i >= curproc->sz || (uint)i+size > curproc->sz)
+  if(size < 0 || (uint)i >= curproc->vm->sz || (uint)i+size > curproc->vm->sz)
     return -1;
   *pp = (char*)i;
   return 0;
@@ -104,9 +104,18 @@ extern int sys_wait(void);
 extern int sys_write(void);
 extern int sys_uptime(void);
 extern int sys_clone(void);
-extern int sys_macquire(void);	// edited
-extern int sys_mrelease(void);	// edited
+extern int sys_futex_wait(void);	// edited
+extern int sys_futex_wake(void);	// edited
 extern int sys_nice(void);		// edited
+extern int sys_kmemstat(void);
+extern int sys_setsched(void);
+extern int sys_setaffinity(void);
+extern int sys_cr3stat(void);
+extern int sys_futex_waitpi(void);
+extern int sys_futex_unlockpi(void);
+extern int sys_join(void);
+extern int sys_settls(void);
+extern int sys_cpucount(void);
 
 static int (*syscalls[])(void) = {
 [SYS_fork]    sys_fork,
@@ -131,9 +140,18 @@ static int (*syscalls[])(void) = {
 [SYS_mkdir]   sys_mkdir,
 [SYS_close]   sys_close,
 [SYS_clone]   sys_clone,
-[SYS_macquire]	sys_macquire, // edited
-[SYS_mrelease]	sys_mrelease, // edited
+[SYS_futex_wait]	sys_futex_wait, // edited
+[SYS_futex_wake]	sys_futex_wake, // edited
 [SYS_nice]    sys_nice,       // edited
+[SYS_kmemstat] sys_kmemstat,
+[SYS_setsched] sys_setsched,
+[SYS_setaffinity] sys_setaffinity,
+[SYS_cr3stat] sys_cr3stat,
+[SYS_futex_waitpi] sys_futex_waitpi,
+[SYS_futex_unlockpi] sys_futex_unlockpi,
+[SYS_join]    sys_join,
+[SYS_settls]  sys_settls,
+[SYS_cpucount] sys_cpucount,
 };
 
 void
@@ -21,7 +21,16 @@
 #define SYS_mkdir  20
 #define SYS_close  21
 #define SYS_clone  22
-#define SYS_macquire 23 // edited
-#define SYS_mrelease 24 // edited
+#define SYS_futex_wait 23 // edited
+#define SYS_futex_wake 24 // edited
 #define SYS_nice   25   // edited
+#define SYS_kmemstat 26
+#define SYS_setsched 27
+#define SYS_setaffinity 28
+#define SYS_cr3stat 29
+#define SYS_futex_waitpi 30
+#define SYS_futex_unlockpi 31
+#define SYS_join 32
+#define SYS_settls 33
+#define SYS_cpucount 34
 
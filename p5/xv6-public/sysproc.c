@@ -6,7 +6,7 @@
 #include "memlayout.h"
 #include "mmu.h"
 #include "proc.h"
-#include "mutex.h"
+#include "kalloc.h"
 
 int
 sys_fork(void)
@@ -60,8 +60,7 @@ sys_sbrk(void)
 
   if(argint(0, &n) < 0)
     return -1;
-  addr = myproc()->sz;
-  if(growproc(n) < 0)
+  if((addr = growproc(n)) < 0)
     return -1;
   return addr;
 }
@@ -69,8 +68,7 @@ sys_sbrk(void)
 int
 sys_sleep(void)
 {
-  int n;
-  uint ticks0;
+  int n, r;
 
   if(argint(0, &n) < 0)
     return -1;
@@ -79,18 +77,9 @@ sys_sleep(void)
     return 0;
   }
   acquire(&tickslock);
-  ticks0 = ticks;
-  myproc()->sleepticks = n;
-  while(ticks - ticks0 < n){
-    if(myproc()->killed){
-      release(&tickslock);
-      return -1;
-    }
-    sleep(&ticks, &tickslock);
-  }
-  myproc()->sleepticks = -1;
+  r = sleepuntil(ticks + n);
   release(&tickslock);
-  return 0;
+  return r;
 }
 
 // return how many clock tick interrupts have occurred
@@ -107,26 +96,70 @@ sys_uptime(void)
 }
 
 // edited section:
-void
-sys_macquire(void)
+int
+sys_futex_wait(void)
 {
-  mutex* m;
-  if (argptr(0, (char **)&m, sizeof(mutex)) < 0) {
-    return;
-  }
+  int addr, val;
 
-  macquire(m);
+  if(argint(0, &addr) < 0 || argint(1, &val) < 0)
+    return -1;
+  return futex_wait(addr, val);
 }
 
-void
-sys_mrelease(void)
+int
+sys_join(void)
 {
-  mutex* m;
-  if (argptr(0, (char **)&m, sizeof(mutex)) < 0) {
-    return;
-  }
+  int tid;
+  void **stack;
+
+  if(argint(0, &tid) < 0 || argptr(1, (char**)&stack, sizeof(*stack)) < 0)
+    return -1;
+  return join(tid, stack);
+}
+
+// Make addr the base of this thread's %gs segment.
+int
+sys_settls(void)
+{
+  struct proc *curproc = myproc();
+  int addr;
+
+  if(argint(0, &addr) < 0)
+    return -1;
+  curproc->tls = addr;
+  curproc->tf->gs = (SEG_UTLS << 3) | DPL_USER;
+  settls(curproc);
+  return 0;
+}
 
-  mrelease(m);
+int
+sys_futex_waitpi(void)
+{
+  int addr, val, spin;
+
+  if(argint(0, &addr) < 0 || argint(1, &val) < 0 || argint(2, &spin) < 0)
+    return -1;
+  return futex_waitpi(addr, val, spin);
+}
+
+int
+sys_futex_wake(void)
+{
+  int addr, n;
+
+  if(argint(0, &addr) < 0 || argint(1, &n) < 0)
+    return -1;
+  return futex_wake(addr, n);
+}
+
+int
+sys_futex_unlockpi(void)
+{
+  int addr;
+
+  if(argint(0, &addr) < 0)
+    return -1;
+  return futex_unlockpi(addr);
 }
 
 int
@@ -138,7 +171,7 @@ sys_nice(void)
   }
 
   struct proc *curproc = myproc();
-  int new_nice = curproc->nice + inc;
+  int new_nice = curproc->basenice + inc;
 
   if (new_nice < -20) {
     new_nice = -20;
@@ -146,7 +179,68 @@ sys_nice(void)
     new_nice = 19;
   }
 
-  curproc->nice = new_nice;
+  setnice(new_nice);
 
   return 0;
 }
+
+// Fill an array of NCPU struct kmemstat with the page
+// allocator's per-CPU counters. Returns the number of CPUs.
+int
+sys_kmemstat(void)
+{
+  struct kmemstat *st;
+
+  if(argptr(0, (char**)&st, NCPU*sizeof(*st)) < 0)
+    return -1;
+  return kmemstat(st);
+}
+
+// Select SCHED_PRIO or SCHED_FAIR scheduling.
+// Returns the previous mode.
+int
+sys_setsched(void)
+{
+  int mode;
+
+  if(argint(0, &mode) < 0)
+    return -1;
+  return setsched(mode);
+}
+
+// Pin process pid to the CPUs whose bits are set in mask.
+int
+sys_setaffinity(void)
+{
+  int pid, mask;
+
+  if(argint(0, &pid) < 0 || argint(1, &mask) < 0)
+    return -1;
+  return setaffinity(pid, mask);
+}
+
+// Report how often the CPUs loaded a user page table into
+// %cr3, and how often switchuvm found it already loaded.
+int
+sys_cr3stat(void)
+{
+  uint *loads, *skips;
+  struct cpu *c;
+
+  if(argptr(0, (char**)&loads, sizeof(*loads)) < 0 ||
+     argptr(1, (char**)&skips, sizeof(*skips)) < 0)
+    return -1;
+  *loads = *skips = 0;
+  for(c = cpus; c < &cpus[ncpu]; c++){
+    *loads += c->cr3loads;
+    *skips += c->cr3skips;
+  }
+  return 0;
+}
+
+// Number of CPUs, e.g. for sizing a pool of threads.
+int
+sys_cpucount(void)
+{
+  return ncpu;
+}
@@ -0,0 +1,254 @@
+// Work-stealing task runtime.
+//
+// task_init starts a fixed set of worker threads once; after
+// that, spawn and sync cost a few memory operations instead of
+// a clone and a join per task. The thread that called task_init
+// is worker 0, whose tasks the others steal while it waits in
+// sync.
+//
+// Each worker owns a Chase-Lev deque: it pushes and pops tasks
+// at the bottom without locks, while idle workers steal from
+// the top with one compare-and-swap. Stealing the oldest task
+// tends to take the biggest piece of a recursive split, so
+// steals stay rare. A full deque makes spawn run the task inline.
+
+#include "types.h"
+#include "user.h"
+#include "atomic.h"
+
+#define NDEQUE 256  // tasks per deque, a power of two
+
+struct task {
+  void (*fn)(void*);
+  void *arg;
+  taskgroup *group;
+  int depth;  // tasks it runs nested inside, counting the spawner
+};
+
+// top and bottom only grow; slots are taken modulo NDEQUE.
+struct deque {
+  volatile uint top;     // next to steal
+  volatile uint bottom;  // next free slot
+  struct task ring[NDEQUE];
+};
+
+static struct worker {
+  int tid;
+  int depth;  // of the task running now, 0 outside any
+  struct deque dq;
+} workers[NWORKER];
+
+static int nworkers;
+static volatile int stopping;
+
+// Owner only. Returns -1 if the deque is full.
+static int
+push(struct deque *d, struct task *t)
+{
+  uint b = d->bottom;
+
+  if(b - d->top >= NDEQUE)
+    return -1;
+  d->ring[b % NDEQUE] = *t;
+  atomic_barrier();  // the task before the slot is published
+  d->bottom = b + 1;
+  return 0;
+}
+
+// Owner only: take the newest task. Returns 0 if there is none.
+static int
+pop(struct deque *d, struct task *t)
+{
+  uint b, top;
+  int ok;
+
+  b = d->bottom - 1;
+  d->bottom = b;
+  atomic_fence();  // claim the slot before looking at top
+  top = d->top;
+  if((int)(b - top) < 0){
+    d->bottom = b + 1;
+    return 0;
+  }
+  *t = d->ring[b % NDEQUE];
+  if(b != top)
+    return 1;
+  // The last task: race thieves for it.
+  ok = atomic_cas(&d->top, top, top + 1) == top;
+  d->bottom = b + 1;
+  return ok;
+}
+
+// Any worker: take the oldest task if it is nested deeper than
+// depth. Returns 0 if there is none, it is not, or another
+// thief got it first.
+static int
+steal(struct deque *d, struct task *t, int depth)
+{
+  uint top, b;
+
+  top = d->top;
+  atomic_barrier();
+  b = d->bottom;
+  if((int)(b - top) <= 0)
+    return 0;
+  *t = d->ring[top % NDEQUE];
+  if(t->depth <= depth)
+    return 0;
+  return atomic_cas(&d->top, top, top + 1) == top;
+}
+
+static struct worker*
+me(void)
+{
+  int i, tid = uthread_self();
+
+  for(i = 0; i < nworkers; i++)
+    if(workers[i].tid == tid)
+      return &workers[i];
+  return 0;
+}
+
+// Run t on worker w, or outside any worker if w is 0.
+static void
+run(struct worker *w, struct task *t)
+{
+  int depth;
+
+  if(w){
+    depth = w->depth;
+    w->depth = t->depth;
+  }
+  t->fn(t->arg);
+  if(w)
+    w->depth = depth;
+  atomic_fetch_add(&t->group->pending, -1);
+}
+
+// Run one task, our own newest if any, else one nested deeper
+// than depth stolen from another worker. Returns 0 if there
+// was nothing to run.
+static int
+runone(struct worker *w, int depth)
+{
+  struct task t;
+  int i, k;
+
+  if(pop(&w->dq, &t)){
+    run(w, &t);
+    return 1;
+  }
+  k = w - workers;
+  for(i = 1; i < nworkers; i++)
+    if(steal(&workers[(k + i) % nworkers].dq, &t, depth)){
+      run(w, &t);
+      return 1;
+    }
+  return 0;
+}
+
+// Wait after *idle tries in a row found nothing to run: spin
+// briefly, then let other threads run, and only after that
+// sleep, which costs a whole tick.
+static void
+backoff(int *idle)
+{
+  if(*idle < 64)
+    pause();
+  else if(*idle < 1024)
+    sleep(0);  // yield
+  else {
+    sleep(1);
+    return;
+  }
+  (*idle)++;
+}
+
+static void
+workerloop(void *arg)
+{
+  struct worker *w = arg;
+  int idle = 0;
+
+  w->tid = uthread_self();
+  while(!stopping){
+    if(runone(w, -1))
+      idle = 0;
+    else
+      backoff(&idle);
+  }
+}
+
+// Start the runtime with n workers, counting the caller, or
+// one per CPU if n is 0. Returns the number of workers.
+int
+task_init(int n)
+{
+  int i, tid;
+
+  if(n <= 0)
+    n = cpucount();
+  if(n > NWORKER)
+    n = NWORKER;
+  workers[0].tid = uthread_self();
+  nworkers = 1;
+  for(i = 1; i < n; i++){
+    workers[i].tid = -1;  // the thread sets it too, if it runs first
+    if((tid = uthread_create(workerloop, &workers[i])) < 0)
+      break;
+    workers[i].tid = tid;
+    nworkers++;
+  }
+  return nworkers;
+}
+
+// Stop the workers. Every group must have been synced.
+void
+task_exit(void)
+{
+  int i;
+
+  stopping = 1;
+  for(i = 1; i < nworkers; i++)
+    uthread_join(workers[i].tid);
+  nworkers = 0;
+  stopping = 0;
+}
+
+// Queue fn(arg) to run on some worker as part of g. Outside
+// a worker, or with the deque full, it runs right away.
+void
+spawn(taskgroup *g, void (*fn)(void*), void *arg)
+{
+  struct worker *w;
+  struct task t;
+
+  t.fn = fn;
+  t.arg = arg;
+  t.group = g;
+  atomic_fetch_add(&g->pending, 1);
+  w = me();
+  t.depth = w ? w->depth + 1 : 1;
+  if(w == 0 || push(&w->dq, &t) < 0)
+    run(w, &t);
+}
+
+// Wait for every task spawned into g, running tasks meanwhile:
+// our own queued ones, which were spawned below this frame, and
+// stolen ones nested deeper than the task we are in. Either
+// kind is smaller than ours, so the stack grows no deeper than
+// the deepest task would alone. With nothing to run for a
+// while, give up the CPU like an idle worker.
+void
+sync(taskgroup *g)
+{
+  struct worker *w = me();
+  int idle = 0;
+
+  while(g->pending){
+    if(w && runone(w, w->depth))
+      idle = 0;
+    else
+      backoff(&idle);
+  }
+}
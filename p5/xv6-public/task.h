@@ -0,0 +1,13 @@
+// Work-stealing task runtime, see task.c.
+
+#ifndef __TASK_H__
+#define __TASK_H__
+
+#define NWORKER 8  // most workers task_init starts
+
+// Tasks spawned into a group; sync waits for all of them.
+typedef struct {
+  volatile uint pending;  // spawned and not yet finished
+} taskgroup;
+
+#endif
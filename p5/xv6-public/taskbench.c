@@ -0,0 +1,136 @@
+// Compare the task runtime with a clone per task on the
+// multithread workload: many small independent jobs, then a
+// recursive fib that spawns nested tasks.
+
+#include "types.h"
+#include "user.h"
+
+#define NTASK 256
+#define WORK  20000
+#define FIB   22
+
+int results[NTASK];
+
+void
+work(void *arg)
+{
+  int i, n = (int)arg, sum = 0;
+
+  for(i = 0; i < WORK; i++)
+    sum += i ^ n;
+  results[n] = sum;
+}
+
+void
+cloned(void *arg)
+{
+  work(arg);
+  exit();
+}
+
+// One clone per task, a CPU's worth at a time, each on a
+// freshly allocated stack, reaped with join().
+int
+bench_clone(int ncpu)
+{
+  char *stacks[NWORKER];
+  void *stack;
+  int i, j, n, start;
+
+  start = uptime();
+  for(i = 0; i < NTASK; i += n){
+    n = NTASK - i < ncpu ? NTASK - i : ncpu;
+    for(j = 0; j < n; j++){
+      stacks[j] = malloc(4096);
+      if(clone(cloned, stacks[j] + 4096, (void*)(i + j)) < 0){
+        printf(2, "taskbench: clone failed\n");
+        exit();
+      }
+    }
+    for(j = 0; j < n; j++)
+      join(-1, &stack);
+    for(j = 0; j < n; j++)
+      free(stacks[j]);
+  }
+  return uptime() - start;
+}
+
+int
+bench_tasks(void)
+{
+  taskgroup g = { 0 };
+  int i, start;
+
+  start = uptime();
+  for(i = 0; i < NTASK; i++)
+    spawn(&g, work, (void*)i);
+  sync(&g);
+  return uptime() - start;
+}
+
+struct fibarg {
+  int n;
+  int r;
+};
+
+void
+fib(void *arg)
+{
+  struct fibarg *f = arg;
+  struct fibarg a, b;
+  taskgroup g = { 0 };
+
+  if(f->n < 2){
+    f->r = f->n;
+    return;
+  }
+  a.n = f->n - 1;
+  b.n = f->n - 2;
+  spawn(&g, fib, &a);
+  fib(&b);
+  sync(&g);
+  f->r = a.r + b.r;
+}
+
+int
+check(void)
+{
+  int i, j, sum;
+
+  for(i = 0; i < NTASK; i++){
+    for(sum = 0, j = 0; j < WORK; j++)
+      sum += j ^ i;
+    if(results[i] != sum)
+      return -1;
+    results[i] = 0;
+  }
+  return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct fibarg f;
+  int ncpu, t;
+
+  ncpu = argc > 1 ? atoi(argv[1]) : cpucount();
+  if(ncpu < 1 || ncpu > NWORKER)
+    ncpu = NWORKER;
+  printf(1, "taskbench: %d tasks, %d threads\n", NTASK, ncpu);
+
+  // Before task_init, so idle workers do not compete.
+  t = bench_clone(ncpu);
+  printf(1, "clone per task: %d ticks%s\n", t, check() ? " WRONG" : "");
+
+  task_init(ncpu);
+  t = bench_tasks();
+  printf(1, "task runtime:   %d ticks%s\n", t, check() ? " WRONG" : "");
+
+  f.n = FIB;
+  t = uptime();
+  fib(&f);
+  printf(1, "fib(%d) = %d with spawn/sync: %d ticks\n", FIB, f.r, uptime() - t);
+
+  task_exit();
+  exit();
+}
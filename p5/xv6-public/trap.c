@@ -51,13 +51,20 @@ trap(struct trapframe *tf)
     if(cpuid() == 0){
       acquire(&tickslock);
       ticks++;
-      // Instead of waking up all sleeping processes, 
-      // only wake up the ones with no sleep time left. 
-      sleep_proc_notify();
+      // Wake only the sleepers whose deadline has come.
+      timerexpire();
       release(&tickslock);
     }
     lapiceoi();
     break;
+  case T_IRQ0 + IRQ_TLBFLUSH:
+    tlbflushintr();
+    lapiceoi();
+    break;
+  case T_IRQ0 + IRQ_RESCHED:
+    // Nothing to do: it just ends an idle CPU's hlt.
+    lapiceoi();
+    break;
   case T_IRQ0 + IRQ_IDE:
     ideintr();
     lapiceoi();
@@ -105,8 +112,10 @@ trap(struct trapframe *tf)
   // Force process to give up CPU on clock tick.
   // If interrupts were on while locks held, would need to check nlock.
   if(myproc() && myproc()->state == RUNNING &&
-     tf->trapno == T_IRQ0+IRQ_TIMER)
+     tf->trapno == T_IRQ0+IRQ_TIMER){
+    schedtick();
     yield();
+  }
 
   // Check if the process has been killed since we yielded
   if(myproc() && myproc()->killed && (tf->cs&3) == DPL_USER)
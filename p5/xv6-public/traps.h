@@ -34,5 +34,7 @@
 #define IRQ_COM1         4
 #define IRQ_IDE         14
 #define IRQ_ERROR       19
+#define IRQ_RESCHED     20      // IPI: work queued for an idle CPU
+#define IRQ_TLBFLUSH    21      // IPI: reload %cr3, see tlbshootdown
 #define IRQ_SPURIOUS    31
 
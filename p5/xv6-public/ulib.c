@@ -3,16 +3,95 @@
 #include "fcntl.h"
 #include "user.h"
 #include "x86.h"
+#include "mmu.h"
 #include "mutex.h"
 
+// The kernel keeps the running process's pid in the
+// limit of the SEG_UPID descriptor.
+static uint
+mypid(void)
+{
+  uint pid;
+
+  asm volatile("lsl %1, %0" : "=r" (pid) : "r" (SEG_UPID<<3 | DPL_USER));
+  return pid;
+}
+
 void
 minit(mutex *m)
 {
-  m->lk.name = "mutex";
-  m->lk.locked = 0;
-  m->lk.cpu = 0;
   m->locked = 0;
-  m->pid = 0; // pid is set to zero until acquired
+  m->adaptive = 0;
+  m->contended = 0;
+  m->spins = 0;
+  m->sleeps = 0;
+  m->handoffs = 0;
+}
+
+// An uncontended acquire is a single compare-and-swap.
+// Otherwise mark the lock word as having waiters and sleep
+// in the kernel, lending our priority to the holder, until
+// the lock is free or the holder hands it to us. An adaptive
+// mutex first spins for as long as the holder is running,
+// leaving the word unmarked so the holder's release stays a
+// compare-and-swap; only once the holder stops running does
+// it mark the word and sleep.
+void
+macquire(mutex *m)
+{
+  int r;
+  uint me, c, spins, sleeps;
+
+  me = mypid();
+  if((c = cmpxchg(&m->locked, 0, me)) == 0)
+    return;
+  spins = sleeps = 0;
+  for(;;){
+    if((c & ~MUTEX_WAITERS) == me){
+      m->handoffs++;
+      break;
+    }
+    if(c == 0){
+      if((c = cmpxchg(&m->locked, 0, me)) == 0)
+        break;
+      continue;
+    }
+    if(m->adaptive){
+      r = futex_waitpi(&m->locked, c, 1);
+      c = m->locked;
+      if(r == FUTEX_SPUN){
+        spins++;
+        continue;
+      }
+      // The holder is not running; sleep on the word as it is now.
+      if(c == 0 || (c & ~MUTEX_WAITERS) == me)
+        continue;
+    }
+    if((c & MUTEX_WAITERS) == 0 &&
+       cmpxchg(&m->locked, c, c | MUTEX_WAITERS) != c){
+      c = m->locked;
+      continue;
+    }
+    if(futex_waitpi(&m->locked, c | MUTEX_WAITERS, 0) == FUTEX_SLEPT)
+      sleeps++;
+    c = m->locked;
+  }
+  // We hold the lock, so these need no atomics.
+  m->contended++;
+  m->spins += spins;
+  m->sleeps += sleeps;
+}
+
+// Without waiters the lock word is just our pid; with them,
+// the kernel passes the lock on to the first.
+void
+mrelease(mutex *m)
+{
+  uint me;
+
+  me = mypid();
+  if(cmpxchg(&m->locked, me, 0) != me)
+    futex_unlockpi(&m->locked);
 }
 
 char*
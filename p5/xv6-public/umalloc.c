@@ -5,6 +5,8 @@
 
 // Memory allocator by Kernighan and Ritchie,
 // The C programming Language, 2nd ed.  Section 8.7.
+// One mutex around the free list makes malloc and free safe
+// to call from threads sharing the address space.
 
 typedef long Align;
 
@@ -20,9 +22,11 @@ typedef union header Header;
 
 static Header base;
 static Header *freep;
+static mutex lock;  // all zeros is an unlocked mutex
 
-void
-free(void *ap)
+// Put the block at ap on the free list. Caller holds lock.
+static void
+free1(void *ap)
 {
   Header *bp, *p;
 
@@ -43,6 +47,14 @@ free(void *ap)
   freep = p;
 }
 
+void
+free(void *ap)
+{
+  macquire(&lock);
+  free1(ap);
+  mrelease(&lock);
+}
+
 static Header*
 morecore(uint nu)
 {
@@ -56,7 +68,7 @@ morecore(uint nu)
     return 0;
   hp = (Header*)p;
   hp->s.size = nu;
-  free((void*)(hp + 1));
+  free1((void*)(hp + 1));
   return freep;
 }
 
@@ -67,6 +79,7 @@ malloc(uint nbytes)
   uint nunits;
 
   nunits = (nbytes + sizeof(Header) - 1)/sizeof(Header) + 1;
+  macquire(&lock);
   if((prevp = freep) == 0){
     base.s.ptr = freep = prevp = &base;
     base.s.size = 0;
@@ -81,10 +94,13 @@ malloc(uint nbytes)
         p->s.size = nunits;
       }
       freep = prevp;
+      mrelease(&lock);
       return (void*)(p + 1);
     }
     if(p == freep)
-      if((p = morecore(nunits)) == 0)
+      if((p = morecore(nunits)) == 0){
+        mrelease(&lock);
         return 0;
+      }
   }
 }
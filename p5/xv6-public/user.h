@@ -1,7 +1,9 @@
 #include "mutex.h"
+#include "task.h"
 
 struct stat;
 struct rtcdate;
+struct kmemstat;
 
 //typedef mutex; // edited
 
@@ -28,9 +30,18 @@ char* sbrk(int);
 int sleep(int);
 int uptime(void);
 int clone(void (*)(void*), void*, void*);
-void macquire(mutex*); // edited
-void mrelease(mutex*); // edited
+int futex_wait(volatile uint*, uint); // edited
+int futex_wake(volatile uint*, int);  // edited
 int nice(int inc);     // edited
+int kmemstat(struct kmemstat*);
+int setsched(int mode);
+int setaffinity(int pid, uint mask);
+int cr3stat(uint *loads, uint *skips);
+int futex_waitpi(volatile uint*, uint, int);
+int futex_unlockpi(volatile uint*);
+int join(int tid, void **stack);
+int settls(void*);
+int cpucount(void);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -46,4 +57,19 @@ void* malloc(uint);
 void free(void*);
 int atoi(const char*);
 void minit(mutex*); // edited
+void macquire(mutex*);
+void mrelease(mutex*);
+
+// uthread.c
+int uthread_create(void (*)(void*), void*);
+int uthread_join(int);
+int uthread_self(void);
+void* uthread_getspecific(int);
+void uthread_setspecific(int, void*);
+
+// task.c
+int task_init(int);
+void task_exit(void);
+void spawn(taskgroup*, void (*)(void*), void*);
+void sync(taskgroup*);
 
@@ -0,0 +1,129 @@
+// User-level threads on top of clone and join.
+//
+// Each thread gets a UTSTACK-byte region from a pool: its
+// stack grows down from the top, beneath a struct uthread
+// that holds its thread-local data. uthread_join hands the
+// region back to the pool, so creating threads in a loop
+// reuses the same few stacks instead of leaking one each time.
+//
+// A thread finds its struct uthread through %gs, whose base
+// settls points at it; the first word is a pointer to itself.
+
+#include "types.h"
+#include "user.h"
+#include "mmu.h"
+
+#define UTSTACK 8192  // bytes per thread, struct uthread included
+#define NUTLS   8     // thread-local slots per thread
+
+struct uthread {
+  struct uthread *self;  // %gs:0
+  int tid;
+  void (*fn)(void*);
+  void *arg;
+  void *tls[NUTLS];      // uthread_getspecific slots
+  struct uthread *next;  // next free region in the pool
+};
+
+static struct uthread mainthread;  // the thread that ran main
+static struct uthread *pool;       // regions of exited threads
+static mutex poollock;
+
+static struct uthread*
+self(void)
+{
+  struct uthread *t;
+  ushort gs;
+
+  asm volatile("movw %%gs, %0" : "=r" (gs));
+  if(gs == 0){
+    if(mainthread.tid == 0)
+      mainthread.tid = getpid();
+    return &mainthread;
+  }
+  asm volatile("movl %%gs:0, %0" : "=r" (t));
+  return t;
+}
+
+static void
+start(void *arg)
+{
+  struct uthread *t = arg;
+
+  settls(t);
+  t->tid = getpid();
+  t->fn(t->arg);
+  exit();
+}
+
+// Run fn(arg) in a new thread. Returns its tid, or -1.
+int
+uthread_create(void (*fn)(void*), void *arg)
+{
+  struct uthread *t;
+  char *stack;
+  int tid;
+
+  macquire(&poollock);
+  if((t = pool) != 0)
+    pool = t->next;
+  else if((stack = malloc(UTSTACK)) != 0)
+    t = (struct uthread*)(stack + UTSTACK) - 1;
+  mrelease(&poollock);
+  if(t == 0)
+    return -1;
+
+  memset(t, 0, sizeof(*t));
+  t->self = t;
+  t->fn = fn;
+  t->arg = arg;
+  // The stack starts just below t.
+  if((tid = clone(start, t, t)) < 0){
+    macquire(&poollock);
+    t->next = pool;
+    pool = t;
+    mrelease(&poollock);
+  }
+  return tid;
+}
+
+// Wait for thread tid, or any thread if tid is -1, to exit,
+// and keep its stack for the next uthread_create. Threads
+// must all have come from uthread_create, not bare clone.
+// Returns the tid joined, or -1.
+int
+uthread_join(int tid)
+{
+  struct uthread *t;
+  void *stack;
+
+  if((tid = join(tid, &stack)) < 0)
+    return -1;
+  t = stack;
+  macquire(&poollock);
+  t->next = pool;
+  pool = t;
+  mrelease(&poollock);
+  return tid;
+}
+
+int
+uthread_self(void)
+{
+  return self()->tid;
+}
+
+void*
+uthread_getspecific(int key)
+{
+  if(key < 0 || key >= NUTLS)
+    return 0;
+  return self()->tls[key];
+}
+
+void
+uthread_setspecific(int key, void *v)
+{
+  if(key >= 0 && key < NUTLS)
+    self()->tls[key] = v;
+}
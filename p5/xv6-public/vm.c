@@ -4,36 +4,15 @@
 #include "x86.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "traps.h"
 #include "proc.h"
+#include "spinlock.h"
+#include "sleeplock.h"
 #include "elf.h"
 
 extern char data[];  // defined by kernel.ld
 pde_t *kpgdir;  // for use in scheduler()
 
-// Reference count for pgdir
-struct uvmdesc uvmrefcount[NPROC];
-
-struct uvmdesc *locate_uvmrefcount(pde_t* pgdir) {
-  for (int i = 0; i < NPROC; i++) {
-    if (uvmrefcount[i].refcount != -1 && uvmrefcount[i].pgdir == pgdir) {
-      return &uvmrefcount[i];
-    }
-  }
-
-  return 0;
-}
-
-struct uvmdesc *allocate_uvmrefcount(pde_t* pgdir, int refcount) {
-  for (int i = 0; i < NPROC; i++) {
-    if (uvmrefcount[i].refcount == -1) {
-      uvmrefcount[i].refcount = refcount;
-      uvmrefcount[i].pgdir = pgdir;
-      return &uvmrefcount[i];
-    }
-  }
-  return 0;
-}
-
 // Set up CPU's kernel segment descriptors.
 // Run once on entry on each CPU.
 void
@@ -148,6 +127,7 @@ setupkvm(void)
   if((pgdir = (pde_t*)kalloc()) == 0)
     return 0;
   memset(pgdir, 0, PGSIZE);
+  kframe((char*)pgdir)->flags |= FRAME_PGDIR;
   if (P2V(PHYSTOP) > (void*)DEVSPACE)
     panic("PHYSTOP too high");
   for(k = kmap; k < &kmap[NELEM(kmap)]; k++)
@@ -159,6 +139,70 @@ setupkvm(void)
   return pgdir;
 }
 
+struct {
+  struct spinlock lock;
+  struct vmspace vm[NPROC];
+} vmtable;
+
+void
+vmspaceinit(void)
+{
+  initlock(&vmtable.lock, "vmtable");
+}
+
+// Wrap pgdir, sz in an address space with one reference.
+// Returns 0 if there are none to spare.
+struct vmspace*
+vmcreate(pde_t *pgdir, uint sz)
+{
+  struct vmspace *vm;
+
+  acquire(&vmtable.lock);
+  for(vm = vmtable.vm; vm < &vmtable.vm[NPROC]; vm++)
+    if(vm->ref == 0){
+      vm->ref = 1;
+      release(&vmtable.lock);
+      initsleeplock(&vm->lock, "vmspace");
+      vm->pgdir = pgdir;
+      vm->sz = sz;
+      return vm;
+    }
+  release(&vmtable.lock);
+  return 0;
+}
+
+// Take another reference to vm for a new thread.
+struct vmspace*
+vmdup(struct vmspace *vm)
+{
+  acquire(&vmtable.lock);
+  if(vm->ref < 1)
+    panic("vmdup");
+  vm->ref++;
+  release(&vmtable.lock);
+  return vm;
+}
+
+// Drop a reference to vm, freeing its memory with the last.
+void
+vmput(struct vmspace *vm)
+{
+  pde_t *pgdir;
+
+  acquire(&vmtable.lock);
+  if(vm->ref < 1)
+    panic("vmput");
+  if(--vm->ref > 0){
+    release(&vmtable.lock);
+    return;
+  }
+  pgdir = vm->pgdir;
+  vm->pgdir = 0;
+  vm->sz = 0;
+  release(&vmtable.lock);
+  freevm(pgdir);
+}
+
 // Allocate one page table for the machine for the kernel address
 // space for scheduler processes.
 void
@@ -176,7 +220,105 @@ switchkvm(void)
   lcr3(V2P(kpgdir));   // switch to the kernel page table
 }
 
+// Make pgdir, or the kernel page table if pgdir is 0, this
+// CPU's page table, leaving %cr3 (and the TLB) alone if it
+// already is. A CPU holds a reference to the user page table
+// it has loaded, so that the last thread of an address space
+// can exit on another CPU without freeing it from under us.
+// Must be called with interrupts off.
+static void
+loadpgdir(pde_t *pgdir)
+{
+  struct cpu *c = mycpu();
+  pde_t *old = c->pgdir;
+
+  if(pgdir == old){
+    if(pgdir)
+      c->cr3skips++;
+    return;
+  }
+  // Publish c->pgdir before loading it, so that tlbshootdown
+  // cannot miss a CPU whose TLB might fill from pgdir.
+  c->pgdir = pgdir;
+  if(pgdir){
+    kref((char*)pgdir);
+    lcr3(V2P(pgdir));
+    c->cr3loads++;
+  } else {
+    lcr3(V2P(kpgdir));
+  }
+  if(old)
+    freevm(old);
+}
+
+// Switch an idle CPU to the kernel page table, releasing
+// the user page table it last ran on.
+void
+idleuvm(void)
+{
+  pushcli();
+  loadpgdir(0);
+  popcli();
+}
+
+// Make sure no TLB still holds translations just removed from
+// pgdir: flush this CPU's, and send each other CPU that has
+// pgdir loaded an IPI to flush its own, waiting until all have.
+// One call covers any number of pages. CPUs on other page
+// tables are left alone. Must be called with interrupts on
+// unless no other CPU can have pgdir loaded, since a CPU waiting
+// here must still answer other CPUs' shootdowns.
+static void
+tlbshootdown(pde_t *pgdir)
+{
+  struct cpu *c;
+  uint seen[NCPU], want = 0;
+  int i;
+
+  __sync_synchronize();  // PTE updates before reading c->pgdir
+  pushcli();
+  for(c = cpus; c < &cpus[ncpu]; c++){
+    if(c->pgdir != pgdir)
+      continue;
+    if(c == mycpu()){
+      lcr3(V2P(pgdir));
+      continue;
+    }
+    i = c - cpus;
+    seen[i] = c->tlbflushes;
+    want |= 1 << i;
+    lapicsendipi(c->apicid, T_IRQ0 + IRQ_TLBFLUSH);
+  }
+  popcli();
+
+  for(i = 0; want; i = (i + 1) % ncpu){
+    if((want & (1 << i)) && cpus[i].tlbflushes != seen[i])
+      want &= ~(1 << i);
+    pause();
+  }
+}
+
+// IRQ_TLBFLUSH: some other CPU changed the page table we run on.
+void
+tlbflushintr(void)
+{
+  lcr3(rcr3());
+  mycpu()->tlbflushes++;
+}
+
+// Point this CPU's SEG_UTLS at p's thread-local storage.
+// A user %gs picks it up when trapret reloads it.
+void
+settls(struct proc *p)
+{
+  pushcli();
+  mycpu()->gdt[SEG_UTLS] = SEG(STA_W, p->tls, 0xffffffff, DPL_USER);
+  popcli();
+}
+
 // Switch TSS and h/w page table to correspond to process p.
+// %cr3 is reloaded only if p runs on a different page table
+// than what this CPU ran last, e.g. not between two threads.
 void
 switchuvm(struct proc *p)
 {
@@ -184,8 +326,8 @@ switchuvm(struct proc *p)
     panic("switchuvm: no process");
   if(p->kstack == 0)
     panic("switchuvm: no kstack");
-  if(p->pgdir == 0)
-    panic("switchuvm: no pgdir");
+  if(p->vm == 0)
+    panic("switchuvm: no vm");
 
   // Used for grading
   log_sched(p);
@@ -200,7 +342,10 @@ switchuvm(struct proc *p)
   // forbids I/O instructions (e.g., inb and outb) from user space
   mycpu()->ts.iomb = (ushort) 0xFFFF;
   ltr(SEG_TSS << 3);
-  lcr3(V2P(p->pgdir));  // switch to process's address space
+  // Lets user code find its pid with lsl instead of a system call.
+  mycpu()->gdt[SEG_UPID] = SEG16(0, 0, p->pid, DPL_USER);
+  settls(p);
+  loadpgdir(p->vm->pgdir);  // switch to process's address space
   popcli();
 }
 
@@ -279,27 +424,42 @@ allocuvm(pde_t *pgdir, uint oldsz, uint newsz)
 // newsz.  oldsz and newsz need not be page-aligned, nor does newsz
 // need to be less than oldsz.  oldsz can be larger than the actual
 // process size.  Returns the new process size.
+//
+// Other threads may be running on pgdir, so the pages are first
+// unmapped, then shot down from every TLB, and only then freed.
+// Each PTE keeps its frame's address until the second pass.
 int
 deallocuvm(pde_t *pgdir, uint oldsz, uint newsz)
 {
   pte_t *pte;
   uint a, pa;
+  int pass, n = 0;
 
   if(newsz >= oldsz)
     return oldsz;
 
-  a = PGROUNDUP(newsz);
-  for(; a  < oldsz; a += PGSIZE){
-    pte = walkpgdir(pgdir, (char*)a, 0);
-    if(!pte)
-      a = PGADDR(PDX(a) + 1, 0, 0) - PGSIZE;
-    else if((*pte & PTE_P) != 0){
-      pa = PTE_ADDR(*pte);
-      if(pa == 0)
-        panic("kfree");
-      char *v = P2V(pa);
-      kfree(v);
-      *pte = 0;
+  for(pass = 0; pass < 2; pass++){
+    if(pass == 1){
+      if(n == 0)
+        break;
+      tlbshootdown(pgdir);
+    }
+    a = PGROUNDUP(newsz);
+    for(; a  < oldsz; a += PGSIZE){
+      pte = walkpgdir(pgdir, (char*)a, 0);
+      if(!pte)
+        a = PGADDR(PDX(a) + 1, 0, 0) - PGSIZE;
+      else if(pass == 0 && (*pte & PTE_P) != 0){
+        *pte &= ~PTE_P;
+        n++;
+      } else if(pass == 1 && *pte != 0){
+        pa = PTE_ADDR(*pte);
+        if(pa == 0)
+          panic("kfree");
+        char *v = P2V(pa);
+        kfree(v);
+        *pte = 0;
+      }
     }
   }
   return newsz;
@@ -310,22 +470,16 @@ deallocuvm(pde_t *pgdir, uint oldsz, uint newsz)
 void
 freevm(pde_t *pgdir)
 {
-  struct uvmdesc *uvmd;
-  // Only free the vm if reference count for its pgdir reaches 0. 
-  if ((uvmd = locate_uvmrefcount(pgdir)) != 0) {
-    if (uvmd->refcount < 1)
-      panic("freevm: invalid uvm refcount");
-    --uvmd->refcount;
-    if (uvmd->refcount != 0)
-      return;
-    else
-      uvmd->refcount = -1;
-  }
-
   uint i;
 
   if(pgdir == 0)
     panic("freevm: no pgdir");
+  if((kframe((char*)pgdir)->flags & FRAME_PGDIR) == 0)
+    panic("freevm: not a pgdir");
+  // The vmspace holds one reference to the pgdir frame, and each
+  // CPU that has it loaded another; the last one tears it down.
+  if(kunref((char*)pgdir) > 0)
+    return;
   deallocuvm(pgdir, KERNBASE, 0);
   for(i = 0; i < NPDENTRIES; i++){
     if(pgdir[i] & PTE_P){
@@ -333,6 +487,7 @@ freevm(pde_t *pgdir)
       kfree(v);
     }
   }
+  kframe((char*)pgdir)->flags &= ~FRAME_PGDIR;
   kfree((char*)pgdir);
 }
 
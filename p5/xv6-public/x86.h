@@ -1,5 +1,8 @@
 // Routines to let C code use special x86 instructions.
 
+#ifndef __X86_H__
+#define __X86_H__
+
 static inline uchar
 inb(ushort port)
 {
@@ -126,10 +129,60 @@ xchg(volatile uint *addr, uint newval)
   asm volatile("lock; xchgl %0, %1" :
                "+m" (*addr), "=a" (result) :
                "1" (newval) :
+               "cc", "memory");
+  return result;
+}
+
+// Atomically replace *addr with newval if it still holds
+// expected. Returns the value *addr held before. Also a
+// compiler barrier, so it can take and drop locks.
+static inline uint
+cmpxchg(volatile uint *addr, uint expected, uint newval)
+{
+  uint result;
+
+  asm volatile("lock; cmpxchgl %2, %1" :
+               "=a" (result), "+m" (*addr) :
+               "r" (newval), "0" (expected) :
+               "cc", "memory");
+  return result;
+}
+
+static inline ushort
+cmpxchgw(volatile ushort *addr, ushort expected, ushort newval)
+{
+  ushort result;
+
+  asm volatile("lock; cmpxchgw %2, %1" :
+               "=a" (result), "+m" (*addr) :
+               "r" (newval), "0" (expected) :
                "cc");
   return result;
 }
 
+// Hint to the CPU that this is a spin-wait loop.
+static inline void
+pause(void)
+{
+  asm volatile("pause");
+}
+
+static inline void
+atomic_incw(volatile ushort *addr)
+{
+  asm volatile("lock; incw %0" : "+m" (*addr) : : "cc");
+}
+
+// Index of the lowest set bit of x, which must be nonzero.
+static inline uint
+bsf(uint x)
+{
+  uint r;
+
+  asm("bsfl %1, %0" : "=r" (r) : "rm" (x) : "cc");
+  return r;
+}
+
 static inline uint
 rcr2(void)
 {
@@ -144,6 +197,14 @@ lcr3(uint val)
   asm volatile("movl %0,%%cr3" : : "r" (val));
 }
 
+static inline uint
+rcr3(void)
+{
+  uint val;
+  asm volatile("movl %%cr3,%0" : "=r" (val));
+  return val;
+}
+
 //PAGEBREAK: 36
 // Layout of the trap frame built on the stack by the
 // hardware and by trapasm.S, and passed to trap().
@@ -181,3 +242,5 @@ struct trapframe {
   ushort ss;
   ushort padding6;
 };
+
+#endif